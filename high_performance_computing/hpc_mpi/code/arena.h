@@ -0,0 +1,142 @@
+/*
+ * arena.h - a rank local arena for buffers that are reused every iteration
+ *
+ * An arena is one block of memory, allocated once, optionally with
+ * MPI_Alloc_mem(), from which cache line aligned buffers are handed out.
+ * Buffers aren't freed one by one: arena_release() gives back everything
+ * allocated since arena_mark(). Running out of the arena is an error, and
+ * ARENA_SIZE() helps to work out how big it must be, e.g.
+ *
+ *   struct arena arena;
+ *   arena_create(&arena, 64 * 1024 * 1024, ARENA_MPI_MEMORY);
+ *   double *u = arena_alloc(&arena, n * sizeof(double));    // kept for the whole run
+ *   for (...) {
+ *       size_t mark = arena_mark(&arena);
+ *       double *tmp = arena_alloc(&arena, n * sizeof(double)); // this iteration only
+ *       ...
+ *       arena_release(&arena, mark);
+ *   }
+ *   arena_report(&arena, "fields", MPI_COMM_WORLD);
+ *   arena_destroy(&arena);
+ *
+ * arena_report() prints the high water mark, so the size can be tuned.
+ */
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <mpi.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define ARENA_ALIGNMENT 64
+
+/* Allocate the arena with MPI_Alloc_mem rather than from the heap */
+#define ARENA_MPI_MEMORY 1
+
+/* The space a buffer of the given size takes up in an arena */
+#define ARENA_SIZE(bytes) (((size_t)(bytes) + ARENA_ALIGNMENT - 1) / ARENA_ALIGNMENT * ARENA_ALIGNMENT)
+
+struct arena {
+    char *base;
+    size_t capacity;
+    size_t used;
+    size_t high_water;
+    long num_allocations;
+    int flags;
+};
+
+static inline void arena_create(struct arena *arena, size_t capacity, int flags)
+{
+    arena->capacity = ARENA_SIZE(capacity);
+    arena->used = 0;
+    arena->high_water = 0;
+    arena->num_allocations = 0;
+    arena->flags = flags;
+    arena->base = NULL;
+
+    if (arena->capacity == 0) {
+        return;
+    }
+    if (flags & ARENA_MPI_MEMORY) {
+        /* MPI_Alloc_mem makes no promise about alignment, so allow for it */
+        arena->capacity += ARENA_ALIGNMENT;
+        if (MPI_Alloc_mem((MPI_Aint)arena->capacity, MPI_INFO_NULL, &arena->base) != MPI_SUCCESS) {
+            arena->base = NULL;
+        }
+    } else {
+        arena->base = aligned_alloc(ARENA_ALIGNMENT, arena->capacity);
+    }
+    if (arena->base == NULL) {
+        fprintf(stderr, "Could not allocate an arena of %zu bytes\n", arena->capacity);
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+}
+
+static inline void arena_destroy(struct arena *arena)
+{
+    if (arena->base != NULL) {
+        if (arena->flags & ARENA_MPI_MEMORY) {
+            MPI_Free_mem(arena->base);
+        } else {
+            free(arena->base);
+        }
+    }
+    arena->base = NULL;
+    arena->capacity = arena->used = 0;
+}
+
+/* Hand out a cache line aligned buffer of the given size */
+static inline void *arena_alloc(struct arena *arena, size_t bytes)
+{
+    /* Find the next aligned address, which for heap arenas is just used */
+    size_t misalignment = (size_t)(arena->base + arena->used) % ARENA_ALIGNMENT;
+    size_t start = arena->used + (misalignment ? ARENA_ALIGNMENT - misalignment : 0);
+    size_t end = start + ARENA_SIZE(bytes);
+
+    if (end > arena->capacity) {
+        fprintf(stderr, "Arena of %zu bytes is full: %zu in use, and %zu more requested\n", arena->capacity,
+                arena->used, bytes);
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+
+    arena->used = end;
+    if (end > arena->high_water) {
+        arena->high_water = end;
+    }
+    arena->num_allocations++;
+    return arena->base + start;
+}
+
+/* Remember how much of the arena is in use, to release back to later */
+static inline size_t arena_mark(const struct arena *arena)
+{
+    return arena->used;
+}
+
+/* Release every buffer allocated since mark was taken */
+static inline void arena_release(struct arena *arena, size_t mark)
+{
+    arena->used = mark;
+}
+
+/* Print the size and high water mark of the arena, from the ranks that
+ * use the least and most of it, on rank 0 of comm */
+static inline void arena_report(const struct arena *arena, const char *name, MPI_Comm comm)
+{
+    double local[2] = {(double)arena->high_water, (double)arena->num_allocations};
+    double least[2], most[2];
+    int rank;
+
+    MPI_Comm_rank(comm, &rank);
+    MPI_Reduce(local, least, 2, MPI_DOUBLE, MPI_MIN, 0, comm);
+    MPI_Reduce(local, most, 2, MPI_DOUBLE, MPI_MAX, 0, comm);
+
+    if (rank == 0) {
+        printf("Arena %s: %zu bytes%s, high water mark %.0f to %.0f bytes, %.0f to %.0f allocations per rank\n",
+               name, arena->capacity, arena->flags & ARENA_MPI_MEMORY ? " from MPI_Alloc_mem" : "", least[0], most[0],
+               least[1], most[1]);
+    }
+}
+
+#endif
@@ -24,6 +24,8 @@ int malloc_debug();
  *  fashion ie last index varies most rapidly.  All storage is got in one     *
  *  block, so to free whole array, just free the pointer array.               *
  *  array = (double***) arralloc(sizeof(double), 3, 10, 12, 5);		      *
+ *  See arralloc_aligned.h for a version with aligned data, 64-bit extents    *
+ *  and NUMA first touch placement.                                           *
  ******************************************************************************/
 
 /* ALIGN returns the next b byte aligned address after a */
@@ -0,0 +1,150 @@
+/*
+ * arralloc_aligned.h - aligned, NUMA friendly multidimensional arrays
+ *
+ * Like arralloc(), allocates an array of any number of dimensions in one
+ * block, indexed as a[i][j][k] with its data contiguous in C order. The
+ * data starts on a cache line, or the given alignment, and extents are
+ * size_t. ARRALLOC_HUGE_PAGES asks for transparent huge pages, and
+ * ARRALLOC_FIRST_TOUCH zeroes the data in parallel, one block of rows per
+ * thread, so a later static schedule finds its rows in local memory;
+ * otherwise the data is left uninitialised. Release it with arrfree(), e.g.
+ *
+ *   size_t extents[2] = {rows, cols};
+ *   double **a = arralloc_aligned(sizeof(double), 2, extents, 0, ARRALLOC_FIRST_TOUCH);
+ *   ...
+ *   arrfree(a);
+ *
+ * Compile with -fopenmp for a parallel first touch.
+ */
+
+#ifndef ARRALLOC_ALIGNED_H
+#define ARRALLOC_ALIGNED_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+#include "cache_line.h"
+
+#define ARRALLOC_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+#define ARRALLOC_HUGE_PAGES 1
+#define ARRALLOC_FIRST_TOUCH 2
+
+/* Kept just in front of the array returned to the caller */
+struct arralloc_header {
+    void *block;
+    size_t bytes;
+};
+
+static inline size_t arralloc_round_up(size_t value, size_t multiple)
+{
+    return (value + multiple - 1) / multiple * multiple;
+}
+
+/* Allocate an array of ndim dimensions with the given extents, whose
+ * elements are size bytes. alignment must be a power of two, or 0 for a
+ * cache line. Returns NULL if the memory can't be allocated. */
+static inline void *arralloc_aligned(size_t size, int ndim, const size_t *extents, size_t alignment, int flags)
+{
+    size_t num_pointers = 0, num_data = 1;
+
+    if (ndim < 1 || size == 0) {
+        return NULL;
+    }
+    if (alignment == 0) {
+        alignment = CACHE_LINE;
+    }
+    if (alignment < sizeof(void *) || (alignment & (alignment - 1)) != 0) {
+        return NULL;
+    }
+    if (flags & ARRALLOC_HUGE_PAGES && alignment < ARRALLOC_HUGE_PAGE_SIZE) {
+        alignment = ARRALLOC_HUGE_PAGE_SIZE;
+    }
+
+    /* Each level of pointers has one entry per element of the levels above */
+    for (int dim = 0; dim < ndim; ++dim) {
+        num_data *= extents[dim];
+        if (dim < ndim - 1) {
+            num_pointers += num_data;
+        }
+    }
+
+    /* The header, then the pointer tables, then the data on an aligned boundary */
+    size_t pointers_offset = arralloc_round_up(sizeof(struct arralloc_header), sizeof(void *));
+    size_t data_offset = arralloc_round_up(pointers_offset + num_pointers * sizeof(void *), alignment);
+    size_t bytes = arralloc_round_up(data_offset + num_data * size, alignment);
+
+    char *block = aligned_alloc(alignment, bytes);
+    if (block == NULL) {
+        return NULL;
+    }
+    char *data = block + data_offset;
+
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+    if (flags & ARRALLOC_HUGE_PAGES) {
+        madvise(block, bytes, MADV_HUGEPAGE);
+    }
+#endif
+
+    if (flags & ARRALLOC_FIRST_TOUCH && num_data > 0) {
+        /* Rows of the first index, or pages of a one dimensional array */
+        const size_t total = num_data * size;
+        const size_t row_bytes = ndim > 1 ? total / extents[0] : 4096;
+        const long rows = (long)((total + row_bytes - 1) / row_bytes);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+        for (long i = 0; i < rows; ++i) {
+            size_t start = i * row_bytes;
+            memset(data + start, 0, total - start < row_bytes ? total - start : row_bytes);
+        }
+    }
+
+    /* Fill in each level of pointers to point into the level below, and the
+     * last level to point at the rows of data */
+    void **level = (void **)(block + pointers_offset);
+    size_t level_size = 1;
+    for (int dim = 0; dim < ndim - 1; ++dim) {
+        size_t next_size = level_size * extents[dim];
+        void **next_level = level + next_size;
+        for (size_t i = 0; i < next_size; ++i) {
+            if (dim < ndim - 2) {
+                level[i] = next_level + i * extents[dim + 1];
+            } else {
+                level[i] = data + i * extents[dim + 1] * size;
+            }
+        }
+        level = next_level;
+        level_size = next_size;
+    }
+
+    void *array = ndim > 1 ? (void *)(block + pointers_offset) : (void *)data;
+    struct arralloc_header *header = (struct arralloc_header *)array - 1;
+    header->block = block;
+    header->bytes = bytes;
+
+    return array;
+}
+
+/* The contiguous data of an array from arralloc_aligned(), e.g. to pass to MPI */
+static inline void *arralloc_data(void *array, int ndim)
+{
+    for (int dim = 0; dim < ndim - 1; ++dim) {
+        array = *(void **)array;
+    }
+    return array;
+}
+
+static inline void arrfree(void *array)
+{
+    if (array != NULL) {
+        free(((struct arralloc_header *)array - 1)->block);
+    }
+}
+
+#endif
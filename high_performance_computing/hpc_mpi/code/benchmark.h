@@ -0,0 +1,335 @@
+/*
+ * benchmark.h - timing the example programs the same way every time
+ *
+ * Each named region is run --warmup times untimed, then --repetitions
+ * times timed, and the minimum, median and maximum are reported, e.g.
+ *
+ *   struct benchmark bench;
+ *   benchmark_create(&bench, argc, argv);
+ *   while (benchmark_next(&bench)) {
+ *       benchmark_start(&bench, "solve");
+ *       ...
+ *       benchmark_stop(&bench, "solve");
+ *   }
+ *   benchmark_report(&bench);
+ *   benchmark_destroy(&bench);
+ *
+ * When mpi.h is included first, each region starts with an MPI_Barrier()
+ * and its time is the slowest rank's. With --results <file> the statistics
+ * and every parameter recorded with params.h are appended to the file, as
+ * CSV if its name ends in .csv and as lines of JSON otherwise.
+ * speedup-table.sh turns a CSV file into a table of speedups.
+ */
+
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "params.h"
+
+#define BENCHMARK_MAX_REGIONS 16
+#define BENCHMARK_NAME_LENGTH 64
+#define BENCHMARK_HEADER_LENGTH (PARAMS_MAX * (PARAMS_NAME_LENGTH + 1) + 64)
+
+struct benchmark_region {
+    char name[BENCHMARK_NAME_LENGTH];
+    double start;
+    int count;     /* timed repetitions so far */
+    double *times; /* of each timed repetition, in seconds */
+};
+
+struct benchmark_stats {
+    int count;
+    double min;
+    double median;
+    double max;
+    double mean;
+};
+
+struct benchmark {
+    const char *program;
+    const char *results; /* the file to append the statistics to, or "" */
+    int warmup;
+    int repetitions;
+    int run; /* counting the warmup runs, -1 before the first */
+    int rank;
+    int num_regions;
+    struct benchmark_region regions[BENCHMARK_MAX_REGIONS];
+};
+
+static inline void benchmark_fail(const char *message, const char *name)
+{
+    fprintf(stderr, message, name);
+#ifdef MPI_VERSION
+    MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+#endif
+    exit(EXIT_FAILURE);
+}
+
+/* The time in seconds since some fixed point */
+static inline double benchmark_time(void)
+{
+#ifdef MPI_VERSION
+    return MPI_Wtime();
+#elif defined(CLOCK_MONOTONIC)
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + 1e-9 * now.tv_nsec;
+#else
+    /* Strict ISO C, without POSIX clocks */
+    struct timespec now;
+    timespec_get(&now, TIME_UTC);
+    return now.tv_sec + 1e-9 * now.tv_nsec;
+#endif
+}
+
+/* Read --warmup, --repetitions and --results, which must be done before
+ * params_print_header() for them to appear in the run header */
+static inline void benchmark_create(struct benchmark *bench, int argc, char **argv)
+{
+    memset(bench, 0, sizeof(*bench));
+    bench->program = params_program_name(argv[0]);
+    bench->warmup = param_long(argc, argv, "warmup", 0);
+    bench->repetitions = param_long(argc, argv, "repetitions", 1);
+    bench->results = param_string(argc, argv, "results", "");
+    bench->run = -1;
+    if (bench->warmup < 0 || bench->repetitions < 1) {
+        benchmark_fail("%s needs at least one repetition and no negative warmup runs\n", bench->program);
+    }
+#ifdef MPI_VERSION
+    MPI_Comm_rank(MPI_COMM_WORLD, &bench->rank);
+#endif
+}
+
+/* Move on to the next run, returning 0 once the warmup runs and all the
+ * repetitions are done */
+static inline int benchmark_next(struct benchmark *bench)
+{
+    return ++bench->run < bench->warmup + bench->repetitions;
+}
+
+/* Whether the current run is a warmup run, whose times aren't kept */
+static inline int benchmark_warming_up(const struct benchmark *bench)
+{
+    return bench->run < bench->warmup;
+}
+
+/* Find a region by name, adding it if it's new */
+static inline struct benchmark_region *benchmark_region(struct benchmark *bench, const char *name)
+{
+    for (int i = 0; i < bench->num_regions; ++i) {
+        if (strcmp(bench->regions[i].name, name) == 0) {
+            return &bench->regions[i];
+        }
+    }
+    if (bench->num_regions == BENCHMARK_MAX_REGIONS) {
+        benchmark_fail("Too many benchmark regions to add %s\n", name);
+    }
+
+    struct benchmark_region *region = &bench->regions[bench->num_regions++];
+    snprintf(region->name, BENCHMARK_NAME_LENGTH, "%s", name);
+    region->count = 0;
+    region->times = malloc(bench->repetitions * sizeof(double));
+    if (region->times == NULL) {
+        benchmark_fail("Could not allocate the times of region %s\n", name);
+    }
+    return region;
+}
+
+static inline void benchmark_start(struct benchmark *bench, const char *name)
+{
+    struct benchmark_region *region = benchmark_region(bench, name);
+#ifdef MPI_VERSION
+    MPI_Barrier(MPI_COMM_WORLD);
+#endif
+    region->start = benchmark_time();
+}
+
+/* Finish timing a region, keeping the time unless this is a warmup run.
+ * Returns the time taken, by the slowest rank with MPI. */
+static inline double benchmark_stop(struct benchmark *bench, const char *name)
+{
+    double elapsed = benchmark_time();
+    struct benchmark_region *region = benchmark_region(bench, name);
+    elapsed -= region->start;
+#ifdef MPI_VERSION
+    MPI_Allreduce(MPI_IN_PLACE, &elapsed, 1, MPI_DOUBLE, MPI_MAX, MPI_COMM_WORLD);
+#endif
+
+    if (!benchmark_warming_up(bench) && region->count < bench->repetitions) {
+        region->times[region->count++] = elapsed;
+    }
+    return elapsed;
+}
+
+static inline int benchmark_compare(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/* The statistics of the timed repetitions of a region so far */
+static inline struct benchmark_stats benchmark_stats(struct benchmark *bench, const char *name)
+{
+    struct benchmark_region *region = benchmark_region(bench, name);
+    struct benchmark_stats stats = {region->count, 0.0, 0.0, 0.0, 0.0};
+    if (region->count == 0) {
+        return stats;
+    }
+
+    double *sorted = malloc(region->count * sizeof(double));
+    if (sorted == NULL) {
+        benchmark_fail("Could not sort the times of region %s\n", name);
+    }
+    memcpy(sorted, region->times, region->count * sizeof(double));
+    qsort(sorted, region->count, sizeof(double), benchmark_compare);
+
+    int middle = region->count / 2;
+    stats.min = sorted[0];
+    stats.max = sorted[region->count - 1];
+    stats.median = region->count % 2 ? sorted[middle] : 0.5 * (sorted[middle - 1] + sorted[middle]);
+    for (int i = 0; i < region->count; ++i) {
+        stats.mean += sorted[i] / region->count;
+    }
+
+    free(sorted);
+    return stats;
+}
+
+/* Print a CSV field, quoting it if it holds a comma or a quote */
+static inline void benchmark_print_csv_field(FILE *out, const char *value)
+{
+    if (strpbrk(value, ",\"\n") == NULL) {
+        fputs(value, out);
+        return;
+    }
+    fputc('"', out);
+    for (const char *c = value; *c != '\0'; ++c) {
+        if (*c == '"') {
+            fputc('"', out);
+        }
+        fputc(*c, out);
+    }
+    fputc('"', out);
+}
+
+/* Write the header line of a CSV results file into header. Parameter
+ * names are identifiers chosen by the program, so they never need quoting. */
+static inline void benchmark_format_csv_header(char *header, size_t size)
+{
+    size_t length = snprintf(header, size, "program");
+    for (int i = 0; i < params_num_used && length < size; ++i) {
+        length += snprintf(header + length, size - length, ",%s", params_used[i].name);
+    }
+    if (length < size) {
+        snprintf(header + length, size - length, ",region,min,median,max,mean\n");
+    }
+}
+
+static inline void benchmark_print_csv_header(FILE *out)
+{
+    char header[BENCHMARK_HEADER_LENGTH];
+    benchmark_format_csv_header(header, sizeof(header));
+    fputs(header, out);
+}
+
+/* Whether the last header line in a CSV results file is the one we would
+ * write, so the new lines can go under it */
+static inline int benchmark_csv_header_matches(const char *path)
+{
+    char header[BENCHMARK_HEADER_LENGTH], line[BENCHMARK_HEADER_LENGTH], last[BENCHMARK_HEADER_LENGTH] = "";
+    benchmark_format_csv_header(header, sizeof(header));
+
+    FILE *in = fopen(path, "r");
+    if (in == NULL) {
+        return 0;
+    }
+    while (fgets(line, sizeof(line), in)) {
+        if (strncmp(line, "program,", 8) == 0) {
+            strcpy(last, line);
+        }
+    }
+    fclose(in);
+    return strcmp(header, last) == 0;
+}
+
+/* Append the statistics of every region to the results file. A CSV file
+ * gets a new header line whenever the columns change, e.g. when a
+ * different program appends to it. */
+static inline void benchmark_write_results(struct benchmark *bench)
+{
+    size_t length = strlen(bench->results);
+    int csv = length >= 4 && strcmp(bench->results + length - 4, ".csv") == 0;
+    int header = csv && !benchmark_csv_header_matches(bench->results);
+
+    FILE *out = fopen(bench->results, "a");
+    if (out == NULL) {
+        benchmark_fail("Could not open the results file %s\n", bench->results);
+    }
+    if (header) {
+        benchmark_print_csv_header(out);
+    }
+
+    for (int r = 0; r < bench->num_regions; ++r) {
+        struct benchmark_region *region = &bench->regions[r];
+        struct benchmark_stats stats = benchmark_stats(bench, region->name);
+
+        if (csv) {
+            benchmark_print_csv_field(out, bench->program);
+            for (int i = 0; i < params_num_used; ++i) {
+                fputc(',', out);
+                benchmark_print_csv_field(out, params_used[i].value);
+            }
+            fputc(',', out);
+            benchmark_print_csv_field(out, region->name);
+            fprintf(out, ",%.9g,%.9g,%.9g,%.9g\n", stats.min, stats.median, stats.max, stats.mean);
+        } else {
+            fputs("{\"program\": ", out);
+            params_print_string(out, bench->program);
+            params_print_members(out);
+            fputs(", \"region\": ", out);
+            params_print_string(out, region->name);
+            fprintf(out, ", \"min\": %.9g, \"median\": %.9g, \"max\": %.9g, \"mean\": %.9g, \"times\": [", stats.min,
+                    stats.median, stats.max, stats.mean);
+            for (int i = 0; i < region->count; ++i) {
+                fprintf(out, i > 0 ? ", %.9g" : "%.9g", region->times[i]);
+            }
+            fputs("]}\n", out);
+        }
+    }
+
+    fclose(out);
+}
+
+/* Print the statistics of every region on rank 0, and append them to the
+ * results file if there is one */
+static inline void benchmark_report(struct benchmark *bench)
+{
+    if (bench->rank != 0) {
+        return;
+    }
+
+    for (int r = 0; r < bench->num_regions; ++r) {
+        struct benchmark_stats stats = benchmark_stats(bench, bench->regions[r].name);
+        printf("Region %s: median %f s, min %f s, max %f s over %d repetitions after %d warmup runs\n",
+               bench->regions[r].name, stats.median, stats.min, stats.max, stats.count, bench->warmup);
+    }
+    if (bench->results[0] != '\0') {
+        benchmark_write_results(bench);
+    }
+}
+
+static inline void benchmark_destroy(struct benchmark *bench)
+{
+    for (int r = 0; r < bench->num_regions; ++r) {
+        free(bench->regions[r].times);
+        bench->regions[r].times = NULL;
+    }
+    bench->num_regions = 0;
+}
+
+#endif
@@ -0,0 +1,38 @@
+/*
+ * cache_line.h - keeping data written by different threads on different
+ * cache lines
+ *
+ * A counter or flag written by one thread and read by others should have a
+ * cache line to itself, so writes to it don't slow down the threads using
+ * its neighbours ("false sharing"), e.g. one per thread
+ *
+ *   struct cache_line_counter *counters = cache_line_alloc(num_threads, sizeof(*counters));
+ *   memset(counters, 0, num_threads * sizeof(*counters));
+ *   ...
+ *   free(counters);
+ */
+
+#ifndef CACHE_LINE_H
+#define CACHE_LINE_H
+
+#include <stdlib.h>
+
+/* The size of a cache line on current x86 and most Arm processors */
+#define CACHE_LINE 64
+
+/* A counter alone on its cache line */
+struct cache_line_counter {
+    long value;
+    char padding[CACHE_LINE - sizeof(long)];
+};
+
+/* Allocate count items of size bytes, starting on a cache line and left
+ * uninitialised like malloc(), so each thread can first touch its own.
+ * Returns NULL if the memory can't be allocated. */
+static inline void *cache_line_alloc(size_t count, size_t size)
+{
+    size_t bytes = (count * size + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+    return aligned_alloc(CACHE_LINE, bytes > 0 ? bytes : CACHE_LINE);
+}
+
+#endif
@@ -1,10 +1,28 @@
+#include <inttypes.h>
 #include <mpi.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <time.h>
+
+#include "monte_carlo.h"
+#include "params.h"
 
 #define ROOT_RANK 0
 
+/* The number of points inside the quarter of the unit circle. Adding up the results of the comparisons, rather
+   than branching on them, lets this loop vectorise. */
+static long quarter_circle(long n, int dims, const double *x, void *context)
+{
+    /* Always called with two dimensions, and needs no context */
+    (void)dims;
+    (void)context;
+    long hits = 0;
+    for (long i = 0; i < n; ++i) {
+        hits += x[2 * i] * x[2 * i] + x[2 * i + 1] * x[2 * i + 1] <= 1.0;
+    }
+    return hits;
+}
+
 int main(int argc, char **argv)
 {
     int my_rank, num_ranks;
@@ -12,26 +30,37 @@ int main(int argc, char **argv)
     MPI_Comm_rank(MPI_COMM_WORLD, &my_rank);
     MPI_Comm_size(MPI_COMM_WORLD, &num_ranks);
 
-    srand(time(NULL) + my_rank);
-
-    int total_num_points = (int)1e8;
-    int points_per_rank = total_num_points / num_ranks;
-    int rank_points_in_circle = 0;
-
-    for (int i = 0; i < points_per_rank; ++i) {
-        double x = (double)rand() / RAND_MAX;
-        double y = (double)rand() / RAND_MAX;
-        if (x * x + y * y <= 1.0) {
-            rank_points_in_circle++;
+    /* The number of points can be changed at run time, e.g. --points 1e12, see params.h */
+    long points = param_long(argc, argv, "points", (long)1e8);
+    uint64_t seed = param_long(argc, argv, "seed", 1);
+    int timing = param_long(argc, argv, "timing", 0);
+    param_record_long("ranks", num_ranks);
+    param_record_long("threads", mc_num_threads());
+    if (my_rank == ROOT_RANK) {
+        params_print_header(stdout, argv[0]);
+    }
+    if (points <= 0) {
+        if (my_rank == ROOT_RANK) {
+            fprintf(stderr, "The number of points must be positive, not %ld\n", points);
         }
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
     }
+    uint64_t total_num_points = points;
 
-    int total_points_in_circle;
-    MPI_Reduce(&rank_points_in_circle, &total_points_in_circle, 1, MPI_INT, MPI_SUM, ROOT_RANK, MPI_COMM_WORLD);
+    /* The fraction of points in the quarter circle is its area, π / 4. The points are shared out between the
+       ranks, and the threads in each, by mc_count() and are the same points for any number of ranks and threads,
+       so for a given seed the estimate is too. The 64-bit counts of points inside are reduced to the root. */
+    struct mc_count_result result;
+    mc_count(quarter_circle, 2, NULL, total_num_points, seed, ROOT_RANK, MPI_COMM_WORLD, &result);
 
     if (my_rank == ROOT_RANK) {
-        double pi = 4.0 * total_points_in_circle / total_num_points;
-        printf("Estimated value of π = %f\n", pi);
+        double pi = 4.0 * result.fraction;
+        printf("Estimated value of π = %f ± %f\n", pi, 4.0 * result.standard_error);
+        if (timing) {
+            int num_cores = num_ranks * mc_num_threads();
+            printf("%" PRIu64 " of %" PRIu64 " points in the circle, %.3f s, %.1f million points per second per core\n",
+                   result.hits, result.samples, result.seconds, result.samples / result.seconds / num_cores / 1e6);
+        }
     }
 
     return MPI_Finalize();
@@ -1,9 +1,32 @@
 #include <stdbool.h>
 #include <stdio.h>
+#include <string.h>
 #include <mpi.h>
 
+#include "../params.h"
+#include "../prime_sieve.h"
+#include "../task_farm.h"
+
+/* The default, which can be changed at run time with --num-iterations, see params.h */
 #define NUM_ITERATIONS 100000
 
+static bool is_prime(long n)
+{
+    // 0 and 1 are not prime numbers
+    if (n == 0 || n == 1) {
+        return false;
+    }
+
+    // if we can only divide n by i, then n is not prime
+    for (long i = 2; i <= n / 2; ++i) {
+        if (n % i == 0) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
 int main(int argc, char **argv)
 {
     int my_rank;
@@ -14,39 +37,65 @@ int main(int argc, char **argv)
     MPI_Comm_rank(MPI_COMM_WORLD, &my_rank);
     MPI_Comm_size(MPI_COMM_WORLD, &num_ranks);
 
-    // calculate how many iterations each rank will deal with
-    int iterations_per_rank = NUM_ITERATIONS / num_ranks;
-    int rank_start = (my_rank * iterations_per_rank) + 1;
-    int rank_end = (my_rank + 1) * iterations_per_rank;
-
-    // catch cases where the work can't be split evenly
-    if (rank_end > NUM_ITERATIONS || (my_rank == (num_ranks - 1) && rank_end < NUM_ITERATIONS)) {
-        rank_end = NUM_ITERATIONS;
+    const long num_iterations = param_long(argc, argv, "num_iterations", NUM_ITERATIONS);
+    // --method sieve counts with the much faster segmented sieve in prime_sieve.h instead
+    const char *method = param_string(argc, argv, "method", "trial");
+    const int sieve = strcmp(method, "sieve") == 0;
+    // --schedule dynamic or guided hands out the work in chunks as ranks become free, see task_farm.h
+    const char *schedule_name = param_string(argc, argv, "schedule", sieve ? "guided" : "static");
+    const int schedule = task_farm_schedule_from_name(schedule_name);
+    // the smallest chunk, in numbers or, for the sieve, in segments for each thread
+    const long chunk_size = param_long(argc, argv, "chunk_size", sieve ? 8 : 1000);
+    const long segment_kib = sieve ? param_long(argc, argv, "segment_kib", 256) : 0;
+    param_record_long("ranks", num_ranks);
+    if (my_rank == 0) {
+        params_print_header(stdout, argv[0]);
     }
-
-    // each rank is dealing with a subset of the problem
-    int prime_count = 0;
-    for (int n = rank_start; n <= rank_end; ++n) {
-        bool is_prime = true;
-
-        // 0 and 1 are not prime numbers
-        if (n == 0 || n == 1) {
-            is_prime = false;
+    if (strcmp(method, "trial") != 0 && !sieve) {
+        if (my_rank == 0) {
+            fprintf(stderr, "Unknown method %s, expected trial or sieve\n", method);
+        }
+        MPI_Finalize();
+        return 1;
+    }
+    if (schedule < 0) {
+        if (my_rank == 0) {
+            fprintf(stderr, "Unknown schedule %s, expected static, dynamic or guided\n", schedule_name);
         }
+        MPI_Finalize();
+        return 1;
+    }
 
-        // if we can only divide n by i, then n is not prime
-        for (int i = 2; i <= n / 2; ++i) {
-            if (n % i == 0) {
-                is_prime = false;
-                break;
+    struct task_farm_stats stats;
+    long prime_count = 0;
+    if (sieve) {
+        prime_count = prime_sieve_count(num_iterations, segment_kib * 1024, chunk_size, schedule, MPI_COMM_WORLD,
+                                        &stats);
+    } else {
+        // each rank takes chunks of the numbers 1 to num_iterations until there are none left. With the static
+        // schedule each rank gets a single chunk, sharing out any remainder so no rank has more than one number
+        // more than another, but as bigger numbers take longer to test the last ranks are left working alone
+        struct task_farm farm;
+        task_farm_create(&farm, num_iterations, schedule, chunk_size, MPI_COMM_WORLD);
+        long first = 0, last = 0;
+        while (task_farm_next(&farm, &first, &last)) {
+            for (long n = first + 1; n <= last; ++n) {
+                if (is_prime(n)) {
+                    prime_count++;
+                }
             }
         }
+        task_farm_finish(&farm);
+        stats = farm.stats;
+    }
+    printf("Rank %d - count of primes in %ld chunks: %ld\n", my_rank, stats.chunks, prime_count);
 
-        if (is_prime) {
-            prime_count++;
-        }
+    long total_count;
+    MPI_Reduce(&prime_count, &total_count, 1, MPI_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
+    task_farm_report(&stats, MPI_COMM_WORLD);
+    if (my_rank == 0) {
+        printf("Count of primes between 1-%ld: %ld\n", num_iterations, total_count);
     }
-    printf("Rank %d - count of primes between %d-%d: %d\n", my_rank, rank_start, rank_end, prime_count);
 
-    MPI_Finalize();
+    return MPI_Finalize();
 }
@@ -7,10 +7,23 @@
 #include <stdio.h>
 #include <math.h>
 #include <stdlib.h>
+#include <string.h>
+#include "../../benchmark.h"
+#include "../../params.h"
 
+// Defaults, which can be changed at run time, see params.h
 #define MAX_ITERATIONS 25000
 #define GRIDSIZE 12
 
+// Floats read or written per point in each iteration, used to estimate
+// memory traffic: poisson_step passes over memory three times (update,
+// residual and copy), the fused step once
+#define STEP_FLOATS_PER_POINT 7
+#define FUSED_FLOATS_PER_POINT 3
+
+// The over-relaxation factor used by the red-black step
+float omega = 1.0;
+
 
 /* Apply a single time step */
 double poisson_step(
@@ -41,44 +54,167 @@ double poisson_step(
 }
 
 
+/* Apply a single time step in one pass over memory.
+ * The new field and the difference from the previous time step are
+ * computed together, and the u and unew buffers are swapped rather than
+ * copied. The operations happen in the same order as in poisson_step, so
+ * the results are identical bit for bit. Both buffers must hold the
+ * boundary values. */
+double poisson_step_fused(
+  float **u, float **unew, float *rho,
+  float hsq, int points
+) {
+  double unorm = 0.0;
+  float *uold = *u, *unext = *unew;
+
+  // Calculate one timestep and its difference from the previous one
+  for (int i = 1; i <= points; i++) {
+     float difference = uold[i-1] + uold[i+1];
+     unext[i] = 0.5 * (difference - hsq*rho[i]);
+     float diff = unext[i]-uold[i];
+     unorm += diff*diff;
+  }
+
+  // The new field becomes the current one
+  *u = unext;
+  *unew = uold;
+
+  return unorm;
+}
+
+
+/* Apply a single red-black Gauss-Seidel step, over-relaxed by omega (SOR).
+ * Points are updated in place, first the odd points and then the even
+ * points, so the even points already see the new values of their
+ * neighbours. With omega = 1 this is plain Gauss-Seidel, and values
+ * between 1 and 2 converge faster. */
+double poisson_step_sor(
+  float *u, float *rho,
+  float hsq, int points
+) {
+  double unorm = 0.0;
+
+  for (int colour = 0; colour < 2; colour++) {
+    for (int i = 1 + colour; i <= points; i += 2) {
+      float difference = u[i-1] + u[i+1];
+      float diff = omega * (0.5 * (difference - hsq*rho[i]) - u[i]);
+      u[i] += diff;
+      unorm += diff*diff;
+    }
+  }
+
+  return unorm;
+}
+
+
+/* A checksum of the bits of the field, to compare results between runs */
+unsigned int checksum(float *field, int points) {
+  unsigned char *bytes = (unsigned char *) field;
+  unsigned int hash = 2166136261u;
+  for (size_t n = 0; n < points * sizeof(*field); n++) {
+    hash = (hash ^ bytes[n]) * 16777619u;
+  }
+  return hash;
+}
+
+
 int main(int argc, char** argv) {
 
   // The heat energy in each block
   float *u, *unew, *rho;
   float h, hsq;
-  double unorm, residual;
-  int i;
-
-  u = malloc(sizeof(*u) * (GRIDSIZE+2));
-  unew = malloc(sizeof(*unew) * (GRIDSIZE+2));
-  rho = malloc(sizeof(*rho) * (GRIDSIZE+2));
+  double unorm = 0.0, residual;
+  int i = 0;
+
+  // Read the parameters, e.g. --gridsize 512
+  // --fused selects the single pass step,
+  // --solver jacobi|gs|sor selects the iterative method,
+  // --omega <w> sets the over-relaxation factor for sor,
+  //   which defaults to the optimum for the grid size,
+  // --timing reports the time taken and the memory traffic,
+  // --repetitions <n> solves n times and reports the median, see benchmark.h
+  int gridsize = param_long(argc, argv, "gridsize", GRIDSIZE);
+  int max_iterations = param_long(argc, argv, "max_iterations", MAX_ITERATIONS);
+  int fused = param_long(argc, argv, "fused", 0);
+  const char *solver = param_string(argc, argv, "solver", "jacobi");
+  int sor = strcmp(solver, "jacobi") != 0;
+  if (sor && strcmp(solver, "gs") != 0 && strcmp(solver, "sor") != 0) {
+    printf("Unknown solver %s, expected jacobi, gs or sor\n", solver);
+    return 1;
+  }
+  if (sor && fused) {
+    printf("--solver gs and sor can't be combined with --fused\n");
+    return 1;
+  }
+  if (sor)
+    omega = param_double(argc, argv, "omega",
+                         strcmp(solver, "gs") == 0 ? 1.0 : 2.0 / (1.0 + sin(M_PI / (gridsize+1))));
+  int timing = param_long(argc, argv, "timing", 0);
+  struct benchmark bench;
+  benchmark_create(&bench, argc, argv);
+  params_print_header(stdout, argv[0]);
+
+  u = malloc(sizeof(*u) * (gridsize+2));
+  unew = malloc(sizeof(*unew) * (gridsize+2));
+  rho = malloc(sizeof(*rho) * (gridsize+2));
 
   // Set up parameters
   h = 0.1;
   hsq = h*h;
   residual = 1e-5;
 
-  // Initialise the u and rho field to 0
-  for (i = 0; i <= GRIDSIZE+1; i++) {
-    u[i] = 0.0;
-    rho[i] = 0.0;
-  }
-
-  // Create a start configuration with the heat energy
-  // u=10 at the x=0 boundary for rank 1
-  u[0] = 10.0;
-
-  // Run iterations until the field reaches an equilibrium
-  // and no longer changes
-  for (i = 0; i < MAX_ITERATIONS; i++) {
-    unorm = poisson_step(u, unew, rho, hsq, GRIDSIZE);
-    if (sqrt(unorm) < sqrt(residual))
-      break;
+  // Every repetition solves from the same start
+  while (benchmark_next(&bench)) {
+    // Initialise the u and rho field to 0
+    for (i = 0; i <= gridsize+1; i++) {
+      u[i] = 0.0;
+      unew[i] = 0.0;
+      rho[i] = 0.0;
+    }
+
+    // Create a start configuration with the heat energy
+    // u=10 at the x=0 boundary for rank 1
+    // unew holds the boundary too, since the fused step swaps the two
+    u[0] = 10.0;
+    unew[0] = 10.0;
+
+    benchmark_start(&bench, "solve");
+
+    // Run iterations until the field reaches an equilibrium
+    // and no longer changes
+    for (i = 0; i < max_iterations; i++) {
+      if (sor)
+        unorm = poisson_step_sor(u, rho, hsq, gridsize);
+      else if (fused)
+        unorm = poisson_step_fused(&u, &unew, rho, hsq, gridsize);
+      else
+        unorm = poisson_step(u, unew, rho, hsq, gridsize);
+      if (sqrt(unorm) < sqrt(residual))
+        break;
+    }
+
+    benchmark_stop(&bench, "solve");
   }
 
   printf("Final result:\n");
-  for (int j = 1; j <= GRIDSIZE; j++) {
+  for (int j = 1; j <= gridsize; j++) {
     printf("%d-", (int) u[j]);
   }
   printf("\nRun completed in %d iterations with residue %g\n", i, unorm);
+
+  if (timing) {
+    double seconds = benchmark_stats(&bench, "solve").median;
+    if (sor) {
+      printf("Red-black SOR step with omega %g, time to solution %f seconds\n", omega, seconds);
+    } else {
+      int floats_per_point = fused ? FUSED_FLOATS_PER_POINT : STEP_FLOATS_PER_POINT;
+      double bytes = (double) floats_per_point * sizeof(float) * gridsize * i;
+      printf("%s step, time to solution %f seconds\n", fused ? "Fused" : "Three pass", seconds);
+      printf("Estimated memory traffic %g bytes (%g GB/s), %d floats per point per iteration\n",
+             bytes, bytes / seconds / 1e9, floats_per_point);
+    }
+    printf("Field checksum %08x, residue %a\n", checksum(&u[1], gridsize), unorm);
+  }
+  benchmark_report(&bench);
+  benchmark_destroy(&bench);
 }
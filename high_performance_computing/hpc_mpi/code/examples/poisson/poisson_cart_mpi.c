@@ -0,0 +1,350 @@
+/* A parallel code for the Poisson equation on 1-D, 2-D or 3-D grids
+ * This will apply the diffusion equation to an initial state
+ * until an equilibrium state is reached.
+ *
+ * The grid is split over a Cartesian process topology built with
+ * MPI_Dims_create and MPI_Cart_create. Grid sizes do not need to divide
+ * evenly by the number of ranks: each rank owns a block whose size differs
+ * from its neighbours' by at most one point in every dimension. After
+ * every step the faces of each block are exchanged with the neighbouring
+ * ranks as halos.
+ *
+ * Usage: mpirun -n <ranks> poisson_cart_mpi [--ndim d] [--gridsize n] [--n0 n] [--n1 n] [--n2 n]
+ * e.g.   mpirun -n 4 poisson_cart_mpi --ndim 2 --gridsize 1024
+ * gridsize sets the points in every dimension, and n0 to n2 override it
+ * for a single dimension (see params.h for the other ways to set them).
+ * With no arguments it runs the same 12-point stick as poisson_mpi.c. */
+
+#include <stdio.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <mpi.h>
+#include "../../benchmark.h"
+#include "../../halo_array.h"
+#include "../../params.h"
+#include "../../partition.h"
+
+// Defaults, which can be changed at run time, see params.h
+#define MAX_ITERATIONS 25000
+#define GRIDSIZE 12
+#define MAX_DIMS 3
+#define MAX_PRINT_POINTS 64
+
+
+/* The part of the global grid owned by this rank.
+ * Internally the field is always stored as a 3-D array, with the ndim
+ * dimensions of the problem mapped onto the last ndim storage dimensions
+ * (so the last problem dimension is contiguous in memory). Unused leading
+ * storage dimensions have one point and no halo. */
+struct domain {
+  int ndim;
+  int global_n[MAX_DIMS];   // points in each problem dimension
+  int dims[MAX_DIMS];       // ranks in each problem dimension
+  int coords[MAX_DIMS];     // position of this rank in the process grid
+  int local_n[MAX_DIMS];    // points owned by this rank
+  int offset[MAX_DIMS];     // global index of the first point owned
+  int below[MAX_DIMS];      // neighbouring ranks, MPI_PROC_NULL at the edges
+  int above[MAX_DIMS];
+  MPI_Comm comm;
+
+  // Storage layout, with strides and face datatypes, indexed by storage
+  // dimension
+  struct halo_array layout;
+};
+
+
+/* Build the process topology, work out which block of the grid this rank
+ * owns and create the datatypes used to exchange its faces */
+void domain_create(struct domain *d, int ndim, const int *global_n, MPI_Comm comm) {
+  int n_ranks, periods[MAX_DIMS] = {0};
+
+  d->ndim = ndim;
+  for (int k = 0; k < MAX_DIMS; k++) {
+    d->dims[k] = 0;
+    d->global_n[k] = k < ndim ? global_n[k] : 1;
+  }
+
+  MPI_Comm_size(comm, &n_ranks);
+  MPI_Dims_create(n_ranks, ndim, d->dims);
+  MPI_Cart_create(comm, ndim, d->dims, periods, 1, &d->comm);
+
+  int rank;
+  MPI_Comm_rank(d->comm, &rank);
+  MPI_Cart_coords(d->comm, rank, ndim, d->coords);
+
+  for (int k = 0; k < ndim; k++) {
+    if (d->dims[k] > d->global_n[k]) {
+      if (rank == 0)
+        printf("Cannot split %d points over %d ranks in dimension %d\n", d->global_n[k], d->dims[k], k);
+      MPI_Abort(comm, 1);
+    }
+    d->local_n[k] = partition_count(d->global_n[k], d->coords[k], d->dims[k]);
+    d->offset[k] = partition_start(d->global_n[k], d->coords[k], d->dims[k]);
+    MPI_Cart_shift(d->comm, k, 1, &d->below[k], &d->above[k]);
+  }
+
+  // Lay out the storage, with a halo of one point on each side of the
+  // problem dimensions, and rows padded to a 64 byte cache line
+  int lead = MAX_DIMS - ndim;
+  int extents[MAX_DIMS], ghost[MAX_DIMS];
+  for (int s = 0; s < MAX_DIMS; s++) {
+    extents[s] = s < lead ? 1 : d->local_n[s - lead];
+    ghost[s] = s < lead ? 0 : 1;
+  }
+  halo_array_create(&d->layout, MAX_DIMS, extents, ghost, 64 / sizeof(float), sizeof(float), MPI_FLOAT);
+}
+
+
+void domain_free(struct domain *d) {
+  halo_array_free(&d->layout);
+  MPI_Comm_free(&d->comm);
+}
+
+
+/* Exchange the faces of the owned block with the neighbouring ranks.
+ * Sends to or from MPI_PROC_NULL at the edges of the grid do nothing,
+ * which leaves the boundary values in place. */
+void halo_exchange(float *u, struct domain *d) {
+  int lead = MAX_DIMS - d->ndim;
+  int below[MAX_DIMS], above[MAX_DIMS];
+
+  for (int s = 0; s < MAX_DIMS; s++) {
+    below[s] = s < lead ? MPI_PROC_NULL : d->below[s - lead];
+    above[s] = s < lead ? MPI_PROC_NULL : d->above[s - lead];
+  }
+  halo_array_exchange(&d->layout, u, d->comm, below, above);
+}
+
+
+/* Find the storage index range [lo, hi) of the points owned by this rank */
+void owned_range(struct domain *d, int *lo, int *hi) {
+  for (int s = 0; s < MAX_DIMS; s++) {
+    lo[s] = d->layout.ghost[s];
+    hi[s] = lo[s] + d->layout.extents[s];
+  }
+}
+
+
+/* Apply a single time step to the block owned by this rank */
+double poisson_step(
+  float *u, float *unew, float *rho,
+  float hsq, struct domain *d
+) {
+  double unorm, global_unorm;
+  int lo[MAX_DIMS], hi[MAX_DIMS];
+  long sy = d->layout.strides[1], sz = d->layout.strides[0];
+  float weight = 1.0 / (2 * d->ndim);
+
+  owned_range(d, lo, hi);
+
+  // Calculate one timestep, using the 2*ndim nearest neighbours.
+  // The innermost loop runs along contiguous memory.
+  for (int i = lo[0]; i < hi[0]; i++) {
+    for (int j = lo[1]; j < hi[1]; j++) {
+      long row = i*sz + j*sy;
+      float *ur = &u[row], *unewr = &unew[row], *rhor = &rho[row];
+
+      if (d->ndim == 1) {
+        for (int k = lo[2]; k < hi[2]; k++) {
+          float difference = ur[k-1] + ur[k+1];
+          unewr[k] = weight * (difference - hsq*rhor[k]);
+        }
+      } else if (d->ndim == 2) {
+        for (int k = lo[2]; k < hi[2]; k++) {
+          float difference = ur[k-1] + ur[k+1] + ur[k-sy] + ur[k+sy];
+          unewr[k] = weight * (difference - hsq*rhor[k]);
+        }
+      } else {
+        for (int k = lo[2]; k < hi[2]; k++) {
+          float difference = ur[k-1] + ur[k+1] + ur[k-sy] + ur[k+sy] + ur[k-sz] + ur[k+sz];
+          unewr[k] = weight * (difference - hsq*rhor[k]);
+        }
+      }
+    }
+  }
+
+  // Find the difference compared to the previous time step
+  unorm = 0.0;
+  for (int i = lo[0]; i < hi[0]; i++) {
+    for (int j = lo[1]; j < hi[1]; j++) {
+      long row = i*sz + j*sy;
+      for (int k = lo[2]; k < hi[2]; k++) {
+        float diff = unew[row+k] - u[row+k];
+        unorm += diff*diff;
+      }
+    }
+  }
+
+  // Use Allreduce to calculate the sum over ranks
+  MPI_Allreduce(&unorm, &global_unorm, 1, MPI_DOUBLE, MPI_SUM, d->comm);
+
+  // Overwrite u with the new field
+  for (int i = lo[0]; i < hi[0]; i++) {
+    for (int j = lo[1]; j < hi[1]; j++) {
+      long row = i*sz + j*sy;
+      for (int k = lo[2]; k < hi[2]; k++)
+        u[row+k] = unew[row+k];
+    }
+  }
+
+  // The u field has been changed, communicate it to neighbours
+  halo_exchange(u, d);
+
+  return global_unorm;
+}
+
+
+/* For small 1-D runs, collect the stick on rank 0 and print it
+ * in the same format as poisson.c and poisson_mpi.c */
+void print_stick(float *u, struct domain *d) {
+  int rank, n_ranks;
+  int *counts = NULL, *displs = NULL;
+  float *resultbuf = NULL;
+
+  MPI_Comm_rank(d->comm, &rank);
+  MPI_Comm_size(d->comm, &n_ranks);
+
+  if (rank == 0) {
+    counts = malloc(sizeof(*counts) * n_ranks);
+    displs = malloc(sizeof(*displs) * n_ranks);
+    resultbuf = malloc(sizeof(*resultbuf) * d->global_n[0]);
+  }
+
+  // Ranks may have been reordered by MPI_Cart_create, so each rank
+  // reports where its points go in the result
+  MPI_Gather(&d->local_n[0], 1, MPI_INT, counts, 1, MPI_INT, 0, d->comm);
+  MPI_Gather(&d->offset[0], 1, MPI_INT, displs, 1, MPI_INT, 0, d->comm);
+  MPI_Gatherv(u, 1, halo_array_interior(&d->layout), resultbuf, counts, displs, MPI_FLOAT, 0, d->comm);
+
+  if (rank == 0) {
+    printf("Final result:\n");
+    for (int j = 0; j < d->global_n[0]; j++) {
+      printf("%d-", (int) resultbuf[j]);
+    }
+    printf("\n");
+    free(counts);
+    free(displs);
+    free(resultbuf);
+  }
+}
+
+
+int main(int argc, char** argv) {
+
+  // The heat energy in each block
+  float *u, *unew, *rho;
+  float ***u_array, ***unew_array, ***rho_array;
+  float h, hsq;
+  double unorm = 0.0, residual, usum, global_usum;
+  int rank, n_ranks;
+  int global_n[MAX_DIMS];
+  struct domain d;
+  int i = 0;
+
+  MPI_Init(&argc, &argv);
+  MPI_Comm_size(MPI_COMM_WORLD, &n_ranks);
+
+  // Read the problem shape
+  int ndim = param_long(argc, argv, "ndim", 1);
+  int gridsize = param_long(argc, argv, "gridsize", GRIDSIZE);
+  int max_iterations = param_long(argc, argv, "max_iterations", MAX_ITERATIONS);
+  if (ndim < 1 || ndim > MAX_DIMS) {
+    printf("ndim must be between 1 and %d\n", MAX_DIMS);
+    MPI_Abort(MPI_COMM_WORLD, 1);
+  }
+  for (int k = 0; k < ndim; k++) {
+    char name[8];
+    snprintf(name, sizeof(name), "n%d", k);
+    global_n[k] = param_long(argc, argv, name, gridsize);
+  }
+  param_record_long("ranks", n_ranks);
+  struct benchmark bench;
+  benchmark_create(&bench, argc, argv);
+
+  domain_create(&d, ndim, global_n, MPI_COMM_WORLD);
+  MPI_Comm_rank(d.comm, &rank);
+  if (rank == 0)
+    params_print_header(stdout, argv[0]);
+
+  // The fields are used through flat pointers with the strides of the layout
+  u_array = halo_array_alloc(&d.layout);
+  unew_array = halo_array_alloc(&d.layout);
+  rho_array = halo_array_alloc(&d.layout);
+  u = halo_array_data(&d.layout, u_array);
+  unew = halo_array_data(&d.layout, unew_array);
+  rho = halo_array_data(&d.layout, rho_array);
+
+  // Set up parameters
+  h = 0.1;
+  hsq = h*h;
+  residual = 1e-5;
+
+  // Every repetition solves from the same start
+  while (benchmark_next(&bench)) {
+    // Initialise the fields, halos included, to 0
+    memset(u, 0, d.layout.size * sizeof(float));
+    memset(unew, 0, d.layout.size * sizeof(float));
+    memset(rho, 0, d.layout.size * sizeof(float));
+
+    // Create a start configuration with the heat energy
+    // u=10 on the lower boundary of the last (contiguous) dimension,
+    // held in the lower halo of the ranks at the start of that dimension
+    if (d.coords[ndim-1] == 0) {
+      for (size_t n = 0; n < d.layout.size; n += d.layout.strides[MAX_DIMS-2])
+        u[n] = 10.0;
+    }
+
+    benchmark_start(&bench, "solve");
+
+    // Run iterations until the field reaches an equilibrium
+    // and no longer changes
+    for (i = 0; i < max_iterations; i++) {
+      unorm = poisson_step(u, unew, rho, hsq, &d);
+      if (sqrt(unorm) < sqrt(residual))
+        break;
+    }
+
+    benchmark_stop(&bench, "solve");
+  }
+  double elapsed = benchmark_stats(&bench, "solve").median;
+
+  // Summarise the final field, since large grids are too big to print
+  int lo[MAX_DIMS], hi[MAX_DIMS];
+  owned_range(&d, lo, hi);
+  usum = 0.0;
+  for (int a = lo[0]; a < hi[0]; a++)
+    for (int b = lo[1]; b < hi[1]; b++)
+      for (int c = lo[2]; c < hi[2]; c++)
+        usum += u[a*d.layout.strides[0] + b*d.layout.strides[1] + c];
+  MPI_Reduce(&usum, &global_usum, 1, MPI_DOUBLE, MPI_SUM, 0, d.comm);
+
+  long total_points = 1;
+  for (int k = 0; k < ndim; k++)
+    total_points *= d.global_n[k];
+
+  if (ndim == 1 && total_points <= MAX_PRINT_POINTS)
+    print_stick(u, &d);
+
+  if (rank == 0) {
+    printf("Grid");
+    for (int k = 0; k < ndim; k++)
+      printf(" %s%d", k ? "x " : "", d.global_n[k]);
+    printf(" on process grid");
+    for (int k = 0; k < ndim; k++)
+      printf(" %s%d", k ? "x " : "", d.dims[k]);
+    printf("\nMean u = %g\n", global_usum / total_points);
+    printf("Run completed in %d iterations with residue %g\n", i, unorm);
+    printf("Time %f seconds, %g point updates per second\n",
+           elapsed, (double) total_points * i / elapsed);
+  }
+  benchmark_report(&bench);
+  benchmark_destroy(&bench);
+
+  arrfree(u_array);
+  arrfree(unew_array);
+  arrfree(rho_array);
+  domain_free(&d);
+
+  MPI_Finalize();
+}
@@ -7,11 +7,40 @@
 #include <stdio.h>
 #include <math.h>
 #include <stdlib.h>
+#include <string.h>
 #include <mpi.h>
+#include "../../arena.h"
+#include "../../benchmark.h"
+#include "../../params.h"
+#include "../../partition.h"
 
+// Defaults, which can be changed at run time, see params.h
 #define MAX_ITERATIONS 25000
 #define GRIDSIZE 12
 
+// Floats read or written per point in each iteration, used to estimate
+// memory traffic: poisson_step passes over memory three times (update,
+// residual and copy), the fused step once
+#define STEP_FLOATS_PER_POINT 7
+#define FUSED_FLOATS_PER_POINT 3
+
+// Time spent exchanging halos and summing the residue over ranks,
+// only measured when timing is switched on
+int timing = 0;
+double halo_time = 0.0;
+double reduce_time = 0.0;
+
+// The over-relaxation factor used by the red-black step
+float omega = 1.0;
+
+// The fields and communication buffers, allocated once for the whole run,
+// by default with MPI_Alloc_mem so the MPI library can register them
+struct arena buffers;
+
+// The index in the whole stick of this rank's first point, which decides
+// the colour of each point in the red-black step
+int rank_offset = 0;
+
 
 /* Apply a single time step */
 double poisson_step(
@@ -46,6 +75,7 @@ double poisson_step(
   // The u field has been changed, communicate it to neighbours
   // With blocking communication, half the ranks should send first
   // and the other half should receive first
+  double start = timing ? MPI_Wtime() : 0.0;
   if ((rank%2) == 1) {
     // Ranks with odd number send first
 
@@ -78,11 +108,302 @@ double poisson_step(
       MPI_Send(&u[points], 1, MPI_FLOAT, rank+1, 2, MPI_COMM_WORLD);
     }
   }
+  if (timing)
+    halo_time += MPI_Wtime() - start;
+
+  return global_unorm;
+}
+
+
+/* Apply a single time step, overlapping the halo exchange with the update
+ * of the interior points.
+ * The halos are exchanged at the start of the step rather than the end,
+ * which gives the same values as poisson_step. The boundary points are only
+ * read while the messages are in flight, and the points next to the halos
+ * are updated once the exchange has completed. */
+double poisson_step_overlap(
+  float *u, float *unew, float *rho,
+  float hsq, int points,
+  int rank, int n_ranks
+) {
+  double unorm, global_unorm;
+  MPI_Request requests[4];
+
+  // Ranks at the ends of the stick have no neighbour on one side.
+  // Communication with MPI_PROC_NULL completes immediately and does nothing.
+  int below = rank > 0 ? rank-1 : MPI_PROC_NULL;
+  int above = rank < n_ranks-1 ? rank+1 : MPI_PROC_NULL;
+
+  // Post the receives for the halos and send our boundary points
+  MPI_Irecv(&u[0], 1, MPI_FLOAT, below, 1, MPI_COMM_WORLD, &requests[0]);
+  MPI_Irecv(&u[points+1], 1, MPI_FLOAT, above, 2, MPI_COMM_WORLD, &requests[1]);
+  MPI_Isend(&u[points], 1, MPI_FLOAT, above, 1, MPI_COMM_WORLD, &requests[2]);
+  MPI_Isend(&u[1], 1, MPI_FLOAT, below, 2, MPI_COMM_WORLD, &requests[3]);
+
+  // Calculate one timestep for the points that don't need the halos
+  for (int i = 2; i <= points-1; i++) {
+     float difference = u[i-1] + u[i+1];
+     unew[i] = 0.5 * (difference - hsq*rho[i]);
+  }
+
+  // Wait for the halos, then finish the points at each end
+  double start = timing ? MPI_Wtime() : 0.0;
+  MPI_Waitall(4, requests, MPI_STATUSES_IGNORE);
+  if (timing)
+    halo_time += MPI_Wtime() - start;
+
+  unew[1] = 0.5 * (u[0] + u[2] - hsq*rho[1]);
+  if (points > 1)
+    unew[points] = 0.5 * (u[points-1] + u[points+1] - hsq*rho[points]);
+
+  // Find the difference compared to the previous time step
+  unorm = 0.0;
+  for (int i = 1;i <= points; i++) {
+     float diff = unew[i]-u[i];
+     unorm += diff*diff;
+  }
+
+  // Use Allreduce to calculate the sum over ranks
+  MPI_Allreduce(&unorm, &global_unorm, 1, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+
+  // Overwrite u with the new field
+  for (int i = 1;i <= points; i++) {
+     u[i] = unew[i];
+  }
+
+  return global_unorm;
+}
+
+
+/* Communicate the points at each end of this rank's part of the stick to
+ * its neighbours. MPI_Sendrecv pairs up the sends and receives, and
+ * MPI_PROC_NULL at the ends of the stick leaves the boundary values in
+ * place. */
+void exchange_halos(float *u, int points, int rank, int n_ranks) {
+  int below = rank > 0 ? rank-1 : MPI_PROC_NULL;
+  int above = rank < n_ranks-1 ? rank+1 : MPI_PROC_NULL;
+  double start = timing ? MPI_Wtime() : 0.0;
+  MPI_Sendrecv(&u[1], 1, MPI_FLOAT, below, 1, &u[points+1], 1, MPI_FLOAT, above, 1,
+               MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+  MPI_Sendrecv(&u[points], 1, MPI_FLOAT, above, 2, &u[0], 1, MPI_FLOAT, below, 2,
+               MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+  if (timing)
+    halo_time += MPI_Wtime() - start;
+}
+
+
+/* Apply a single time step in one pass over memory, returning this rank's
+ * part of the difference from the previous time step.
+ * The new field and the difference are computed together, and the u and
+ * unew buffers are swapped rather than copied. The operations happen in
+ * the same order as in poisson_step, so the results are identical bit for
+ * bit. Both buffers must hold the boundary values in their halos. */
+double poisson_step_local(
+  float **u, float **unew, float *rho,
+  float hsq, int points,
+  int rank, int n_ranks
+) {
+  double unorm = 0.0;
+  float *uold = *u, *unext = *unew;
+
+  // Calculate one timestep and its difference from the previous one
+  for (int i = 1; i <= points; i++) {
+     float difference = uold[i-1] + uold[i+1];
+     unext[i] = 0.5 * (difference - hsq*rho[i]);
+     float diff = unext[i]-uold[i];
+     unorm += diff*diff;
+  }
+
+  // The new field becomes the current one
+  *u = unext;
+  *unew = uold;
+
+  // Communicate the new field to neighbours
+  exchange_halos(unext, points, rank, n_ranks);
+
+  return unorm;
+}
+
+
+/* Apply a single time step in one pass over memory,
+ * and sum the difference from the previous time step over all ranks */
+double poisson_step_fused(
+  float **u, float **unew, float *rho,
+  float hsq, int points,
+  int rank, int n_ranks
+) {
+  double global_unorm;
+  double unorm = poisson_step_local(u, unew, rho, hsq, points, rank, n_ranks);
+
+  // Use Allreduce to calculate the sum over ranks
+  double start = timing ? MPI_Wtime() : 0.0;
+  MPI_Allreduce(&unorm, &global_unorm, 1, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+  if (timing)
+    reduce_time += MPI_Wtime() - start;
+
+  return global_unorm;
+}
+
+
+/* Apply a single red-black Gauss-Seidel step, over-relaxed by omega (SOR).
+ * Points are updated in place, first the odd points and then the even
+ * points of the whole stick, so the even points already see the new values
+ * of their neighbours. The colour of a point depends on its position in the
+ * whole stick, so the result does not depend on the number of ranks, and
+ * the halos are exchanged after each colour. With omega = 1 this is plain
+ * Gauss-Seidel, and values between 1 and 2 converge faster. */
+double poisson_step_sor(
+  float *u, float *rho,
+  float hsq, int points,
+  int rank, int n_ranks
+) {
+  double unorm = 0.0, global_unorm;
+  int offset = rank_offset;
+
+  for (int colour = 0; colour < 2; colour++) {
+    // The first local point with the same parity as this colour's points
+    // in the serial code
+    int first = (offset + 1) % 2 == (1 + colour) % 2 ? 1 : 2;
+    for (int i = first; i <= points; i += 2) {
+      float difference = u[i-1] + u[i+1];
+      float diff = omega * (0.5 * (difference - hsq*rho[i]) - u[i]);
+      u[i] += diff;
+      unorm += diff*diff;
+    }
+
+    exchange_halos(u, points, rank, n_ranks);
+  }
+
+  // Use Allreduce to calculate the sum over ranks
+  double start = timing ? MPI_Wtime() : 0.0;
+  MPI_Allreduce(&unorm, &global_unorm, 1, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+  if (timing)
+    reduce_time += MPI_Wtime() - start;
 
   return global_unorm;
 }
 
 
+/* Find the first entry in a history of residues that has converged */
+int first_converged(double *unorms, int count, double residual) {
+  for (int n = 0; n < count; n++) {
+    if (sqrt(unorms[n]) < sqrt(residual))
+      return n;
+  }
+  return -1;
+}
+
+
+/* Run iterations until the field reaches an equilibrium, only summing the
+ * residue over ranks every check_every iterations.
+ * Each rank keeps the residues of the iterations since the last check and
+ * they are all summed in one reduction, which costs about the same as
+ * summing one, so the exact iteration at which the field converged is
+ * known. With pipelined set the sum is started with MPI_Iallreduce and
+ * only completed after the next iteration has been computed, hiding its
+ * latency behind that iteration.
+ * Returns the index of the last iteration run once the field has
+ * converged, or max_iterations if it never did, as the loop checking every
+ * iteration would, and sets converged_at to the index at which that loop
+ * would have stopped. */
+int iterate_with_checks(
+  float **u, float **unew, float *rho,
+  float hsq, int points,
+  int rank, int n_ranks,
+  double residual, int max_iterations, int check_every, int pipelined,
+  double *unorm, int *converged_at, int *n_reductions
+) {
+  // Two buffers of local residues, so one can be filled while the
+  // other is being reduced
+  size_t mark = arena_mark(&buffers);
+  double *local[2], *global;
+  local[0] = arena_alloc(&buffers, sizeof(double) * check_every);
+  local[1] = arena_alloc(&buffers, sizeof(double) * check_every);
+  global = arena_alloc(&buffers, sizeof(double) * check_every);
+
+  MPI_Request request;
+  int buf = 0, filled = 0;
+  int pending = 0, pending_first = 0, pending_count = 0;
+  int i;
+
+  *converged_at = -1;
+  *n_reductions = 0;
+
+  for (i = 0; i < max_iterations; i++) {
+    local[buf][filled++] = poisson_step_local(u, unew, rho, hsq, points, rank, n_ranks);
+
+    // Complete the sum started on the previous check,
+    // now that another iteration has been computed
+    if (pending) {
+      double start = timing ? MPI_Wtime() : 0.0;
+      MPI_Wait(&request, MPI_STATUS_IGNORE);
+      if (timing)
+        reduce_time += MPI_Wtime() - start;
+      pending = 0;
+
+      *unorm = global[pending_count-1];
+      int n = first_converged(global, pending_count, residual);
+      if (n >= 0) {
+        *converged_at = pending_first + n;
+        break;
+      }
+    }
+
+    if (filled == check_every || i == max_iterations-1) {
+      double start = timing ? MPI_Wtime() : 0.0;
+      (*n_reductions)++;
+      if (pipelined) {
+        MPI_Iallreduce(local[buf], global, filled, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD, &request);
+        pending = 1;
+        pending_first = i - filled + 1;
+        pending_count = filled;
+        buf = 1 - buf;
+      } else {
+        MPI_Allreduce(local[buf], global, filled, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+      }
+      if (timing)
+        reduce_time += MPI_Wtime() - start;
+
+      if (!pipelined) {
+        *unorm = global[filled-1];
+        int n = first_converged(global, filled, residual);
+        if (n >= 0) {
+          *converged_at = i - filled + 1 + n;
+          break;
+        }
+      }
+      filled = 0;
+    }
+  }
+
+  // A sum started on the final iteration has nothing left to overlap with
+  if (pending) {
+    MPI_Wait(&request, MPI_STATUS_IGNORE);
+    *unorm = global[pending_count-1];
+    int n = first_converged(global, pending_count, residual);
+    if (n >= 0) {
+      *converged_at = pending_first + n;
+      i = max_iterations-1;
+    }
+  }
+
+  arena_release(&buffers, mark);
+
+  return i;
+}
+
+
+/* A checksum of the bits of the field, to compare results between runs */
+unsigned int checksum(float *field, int points) {
+  unsigned char *bytes = (unsigned char *) field;
+  unsigned int hash = 2166136261u;
+  for (size_t n = 0; n < points * sizeof(*field); n++) {
+    hash = (hash ^ bytes[n]) * 16777619u;
+  }
+  return hash;
+}
+
+
 int main(int argc, char** argv) {
 
   // The heat energy in each block
@@ -91,55 +412,198 @@ int main(int argc, char** argv) {
   double unorm, residual;
   int rank, n_ranks, rank_gridsize;
   float *resultbuf;
-  int i;
+  int i = 0;
+  int converged_at, n_reductions;
 
   MPI_Init(&argc, &argv);
 
+  // Read the parameters, e.g. --gridsize 512
+  // --overlap selects the non-blocking halo exchange,
+  // --fused selects the single pass step,
+  // --check-every <k> only sums the residue over ranks every k iterations,
+  // --pipelined overlaps that sum with the following iteration,
+  // --solver jacobi|gs|sor selects the iterative method,
+  // --omega <w> sets the over-relaxation factor for sor,
+  //   which defaults to the optimum for the grid size,
+  // --timing reports how long is spent communicating,
+  // --repetitions <n> solves n times and reports the median, see benchmark.h
+  // --alloc-mem 0 takes the buffers from the heap instead of MPI_Alloc_mem
+  int gridsize = param_long(argc, argv, "gridsize", GRIDSIZE);
+  int max_iterations = param_long(argc, argv, "max_iterations", MAX_ITERATIONS);
+  int overlap = param_long(argc, argv, "overlap", 0);
+  int fused = param_long(argc, argv, "fused", 0);
+  int check_every = param_long(argc, argv, "check_every", 1);
+  int pipelined = param_long(argc, argv, "pipelined", 0);
+  const char *solver = param_string(argc, argv, "solver", "jacobi");
+  int sor = strcmp(solver, "jacobi") != 0;
+  if (sor)
+    omega = param_double(argc, argv, "omega",
+                         strcmp(solver, "gs") == 0 ? 1.0 : 2.0 / (1.0 + sin(M_PI / (gridsize+1))));
+  timing = param_long(argc, argv, "timing", 0);
+  int alloc_mem = param_long(argc, argv, "alloc_mem", 1);
+  struct benchmark bench;
+  benchmark_create(&bench, argc, argv);
+
   // Find the number of x-slices calculated by each rank
-  // The simple calculation here assumes that GRIDSIZE is divisible by n_ranks
+  // Any remainder is shared out so no rank has more than one extra slice
   MPI_Comm_rank(MPI_COMM_WORLD, &rank);
   MPI_Comm_size(MPI_COMM_WORLD, &n_ranks);
-  rank_gridsize = GRIDSIZE / n_ranks;
+  rank_gridsize = partition_count(gridsize, rank, n_ranks);
+  rank_offset = partition_start(gridsize, rank, n_ranks);
+  if (gridsize < n_ranks) {
+    if (rank == 0)
+      printf("The grid size %d must be at least the number of ranks\n", gridsize);
+    MPI_Abort(MPI_COMM_WORLD, 1);
+  }
+
+  // The convergence check policies are built on the fused Jacobi step,
+  // and each step has its own halo exchange, so refuse to combine options
+  // that would otherwise be quietly ignored
+  if (check_every < 1)
+    check_every = 1;
+  int checked = check_every > 1 || pipelined;
+  if (sor && strcmp(solver, "gs") != 0 && strcmp(solver, "sor") != 0) {
+    if (rank == 0)
+      printf("Unknown solver %s, expected jacobi, gs or sor\n", solver);
+    MPI_Abort(MPI_COMM_WORLD, 1);
+  }
+  const char *conflict = NULL;
+  if (sor && (overlap || fused || checked))
+    conflict = "--solver gs and sor can't be combined with --overlap, --fused, --check-every or --pipelined";
+  else if (overlap && (fused || checked))
+    conflict = "--overlap can't be combined with --fused, --check-every or --pipelined";
+  if (conflict != NULL) {
+    if (rank == 0)
+      printf("%s\n", conflict);
+    MPI_Abort(MPI_COMM_WORLD, 1);
+  }
+  if (checked)
+    fused = 1;
+  param_record("step", sor ? solver : fused ? "fused" : overlap ? "overlap" : "three_pass", PARAM_STRING);
+
+  param_record_long("ranks", n_ranks);
+  if (rank == 0)
+    params_print_header(stdout, argv[0]);
+
 
-  u = malloc(sizeof(*u) * (rank_gridsize + 2));
-  unew = malloc(sizeof(*unew) * (rank_gridsize + 2));
-  rho = malloc(sizeof(*rho) * (rank_gridsize + 2));
+  // Make room for the three fields, the gathered result and the
+  // residue history used by the convergence checks
+  size_t field_bytes = sizeof(float) * (rank_gridsize + 2);
+  arena_create(&buffers,
+               3 * ARENA_SIZE(field_bytes) + ARENA_SIZE(sizeof(float) * gridsize)
+                 + 3 * ARENA_SIZE(sizeof(double) * check_every),
+               alloc_mem ? ARENA_MPI_MEMORY : 0);
+  u = arena_alloc(&buffers, field_bytes);
+  unew = arena_alloc(&buffers, field_bytes);
+  rho = arena_alloc(&buffers, field_bytes);
 
   // Set up parameters
   h = 0.1;
   hsq = h*h;
   residual = 1e-5;
 
-  // Initialise the u and rho field to 0
-  for (i = 0; i <= rank_gridsize+1; i++) {
-    u[i] = 0.0;
-    rho[i] = 0.0;
-  }
+  // Every repetition solves from the same start, and the communication
+  // times are summed over the timed repetitions
+  double halo_total = 0.0, reduce_total = 0.0;
+  while (benchmark_next(&bench)) {
+    // Initialise the u and rho field to 0
+    for (i = 0; i <= rank_gridsize+1; i++) {
+      u[i] = 0.0;
+      unew[i] = 0.0;
+      rho[i] = 0.0;
+    }
 
-  // Create a start configuration with the heat energy
-  // u=10 at the x=0 boundary for rank 0
-  if (rank == 0)
-    u[0] = 10.0;
+    // Create a start configuration with the heat energy
+    // u=10 at the x=0 boundary for rank 0
+    // unew holds the boundary too, since the fused step swaps the two
+    if (rank == 0) {
+      u[0] = 10.0;
+      unew[0] = 10.0;
+    }
+    halo_time = 0.0;
+    reduce_time = 0.0;
 
-  // Run iterations until the field reaches an equilibrium
-  // and no longer changes
-  for (i = 0; i < MAX_ITERATIONS; i++) {
-    unorm = poisson_step( u, unew, rho, hsq, rank_gridsize, rank, n_ranks );
-    if (sqrt(unorm) < sqrt(residual))
-      break;
+    benchmark_start(&bench, "solve");
+
+    // Run iterations until the field reaches an equilibrium
+    // and no longer changes
+    if (checked)
+      i = iterate_with_checks( &u, &unew, rho, hsq, rank_gridsize, rank, n_ranks,
+                               residual, max_iterations, check_every, pipelined, &unorm, &converged_at, &n_reductions );
+    else for (i = 0; i < max_iterations; i++) {
+      if (sor)
+        unorm = poisson_step_sor( u, rho, hsq, rank_gridsize, rank, n_ranks );
+      else if (fused)
+        unorm = poisson_step_fused( &u, &unew, rho, hsq, rank_gridsize, rank, n_ranks );
+      else if (overlap)
+        unorm = poisson_step_overlap( u, unew, rho, hsq, rank_gridsize, rank, n_ranks );
+      else
+        unorm = poisson_step( u, unew, rho, hsq, rank_gridsize, rank, n_ranks );
+      if (sqrt(unorm) < sqrt(residual))
+        break;
+    }
+
+    benchmark_stop(&bench, "solve");
+    if (!benchmark_warming_up(&bench)) {
+      halo_total += halo_time;
+      reduce_total += reduce_time;
+    }
   }
 
   // Gather results from all ranks
-  // We need to send data starting from the second element of u, since u[0] is a boundary  resultbuf = malloc(sizeof(*resultbuf) * GRIDSIZE);
-  MPI_Gather(&u[1], rank_gridsize, MPI_FLOAT, resultbuf, rank_gridsize, MPI_FLOAT, 0, MPI_COMM_WORLD);
+  // We need to send data starting from the second element of u, since u[0] is a boundary
+  resultbuf = arena_alloc(&buffers, sizeof(*resultbuf) * gridsize);
+  struct partition slices;
+  partition_create(&slices, gridsize, n_ranks, 1);
+  MPI_Gatherv(&u[1], rank_gridsize, MPI_FLOAT, resultbuf, slices.counts, slices.displs, MPI_FLOAT, 0, MPI_COMM_WORLD);
+  partition_free(&slices);
 
   if (rank == 0) {
     printf("Final result:\n");
-    for (int j = 0; j < GRIDSIZE; j++) {
+    for (int j = 0; j < gridsize; j++) {
       printf("%d-", (int) resultbuf[j]);
     }
-    printf("\nRun completed in %d iterations with residue %g\n", i, unorm, n_ranks);
+    printf("\nRun completed in %d iterations with residue %g\n", i, unorm);
+    if (checked) {
+      printf("Residue summed every %d iterations%s: %d reductions, ", check_every,
+             pipelined ? " and pipelined" : "", n_reductions);
+      if (converged_at >= 0)
+        printf("converged at iteration %d, %d extra iterations\n", converged_at, i - converged_at);
+      else
+        printf("did not converge\n");
+    }
+  }
+
+  if (timing) {
+    // The slowest rank determines the run time, so report the maximum,
+    // taking the median solve and the mean time spent communicating
+    double times[2] = {halo_total / bench.repetitions, reduce_total / bench.repetitions}, max_times[3];
+    max_times[0] = benchmark_stats(&bench, "solve").median;
+    MPI_Reduce(times, &max_times[1], 2, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+    if (rank == 0) {
+      if (sor)
+        printf("Red-black SOR step with omega %g on %d ranks\n", omega, n_ranks);
+      else
+        printf("%s step, %s halo exchange on %d ranks\n", fused ? "Fused" : "Three pass",
+               overlap && !fused ? "non-blocking" : "blocking", n_ranks);
+      printf("Time to solution %f seconds, of which waiting for halos %f seconds (%.1f%%)\n",
+             max_times[0], max_times[1], 100.0 * max_times[1] / max_times[0]);
+      if (fused || sor)
+        printf("Waiting for the residue sum %f seconds (%.1f%%)\n",
+               max_times[2], 100.0 * max_times[2] / max_times[0]);
+      if (!sor) {
+        int floats_per_point = fused ? FUSED_FLOATS_PER_POINT : STEP_FLOATS_PER_POINT;
+        double bytes = (double) floats_per_point * sizeof(float) * gridsize * i;
+        printf("Estimated memory traffic %g bytes (%g GB/s), %d floats per point per iteration\n",
+               bytes, bytes / max_times[0] / 1e9, floats_per_point);
+      }
+      printf("Field checksum %08x, residue %a\n", checksum(resultbuf, gridsize), unorm);
+    }
+    arena_report(&buffers, "buffers", MPI_COMM_WORLD);
   }
+  benchmark_report(&bench);
+  benchmark_destroy(&bench);
 
+  arena_destroy(&buffers);
   MPI_Finalize();
 }
@@ -0,0 +1,415 @@
+/* A parallel multigrid code for the Poisson equation
+ * This will apply the diffusion equation to an initial state
+ * until an equilibrium state is reached.
+ *
+ * The stick is solved with geometric multigrid V-cycles. The Jacobi step
+ * from poisson_mpi.c, damped so that it smooths the error, removes the
+ * rapidly varying part of the error on each grid. What is left is
+ * restricted to a grid with half the points, where it varies rapidly
+ * again, down to a grid small enough to solve with plain Jacobi steps.
+ * The corrections are then interpolated (prolonged) back up to the finer
+ * grids.
+ *
+ * Each level is split over the ranks in the same way as its finer level.
+ * Once the levels get so coarse that a rank would own only a handful of
+ * points, the remaining levels are agglomerated onto rank 0, where
+ * communicating would cost more than computing.
+ *
+ * Coarse point j lies at fine point 2j, so when the number of points is
+ * even the last coarse point is closer to the boundary than the spacing of
+ * the coarse grid. Each level remembers that distance, and its last point
+ * uses a stencil for unevenly spaced points, so any grid size coarsens all
+ * the way down.
+ *
+ * Usage: mpirun -n <ranks> poisson_multigrid_mpi [--gridsize n] [--max-cycles n]
+ * (see params.h for the other ways to set them) */
+
+#include <stdio.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <mpi.h>
+#include "../../benchmark.h"
+#include "../../params.h"
+#include "../../partition.h"
+
+// Defaults for the parameters that can be changed at run time
+#define MAX_CYCLES 100
+#define GRIDSIZE 1023
+#define MAX_LEVELS 32
+#define PRE_SWEEPS 2
+#define POST_SWEEPS 2
+#define JACOBI_WEIGHT (2.0 / 3.0)
+#define COARSE_SWEEPS 50
+#define MIN_LOCAL_POINTS 4
+#define MAX_PRINT_POINTS 64
+
+
+/* One grid in the multigrid hierarchy, as seen by this rank */
+struct level {
+  int n;              // points in the whole stick at this level
+  int offset, count;  // this rank owns points offset+1 to offset+count
+  int active;         // whether this rank takes part at this level
+  float hsq;          // the grid spacing squared
+  float gap;          // from the last point to the boundary, in grid spacings
+  float *u, *unew, *rho, *res;  // count+2 points, including the halos
+  MPI_Comm comm;
+  int rank, n_ranks, below, above;
+
+  // How the next coarser level is laid out. If agglomerate is set it is
+  // held on rank 0, and the parts restricted by each rank are gathered
+  // there using counts and displs.
+  int coarse_offset, coarse_count;
+  int agglomerate;
+  int *counts, *displs;
+  float *coarse;      // the whole coarser level, for agglomeration
+};
+
+
+void level_init(struct level *l, int n, float hsq, float gap, MPI_Comm comm, int offset, int count) {
+  l->n = n;
+  l->gap = gap;
+  l->offset = offset;
+  l->count = count;
+  l->active = 1;
+  l->hsq = hsq;
+  l->comm = comm;
+  l->agglomerate = 0;
+  l->counts = l->displs = NULL;
+  l->coarse = NULL;
+  MPI_Comm_rank(comm, &l->rank);
+  MPI_Comm_size(comm, &l->n_ranks);
+  l->below = l->rank > 0 ? l->rank-1 : MPI_PROC_NULL;
+  l->above = l->rank < l->n_ranks-1 ? l->rank+1 : MPI_PROC_NULL;
+
+  l->u = calloc(count+2, sizeof(*l->u));
+  l->unew = calloc(count+2, sizeof(*l->unew));
+  l->rho = calloc(count+2, sizeof(*l->rho));
+  l->res = calloc(count+2, sizeof(*l->res));
+}
+
+
+void level_free(struct level *l) {
+  if (!l->active)
+    return;
+  free(l->u);
+  free(l->unew);
+  free(l->rho);
+  free(l->res);
+  free(l->counts);
+  free(l->displs);
+  free(l->coarse);
+}
+
+
+/* Build the hierarchy of grids, starting from the finest grid with n
+ * points split over the ranks in comm. Coarse point j lies at fine point
+ * 2j, so each rank keeps the coarse points that lie within its part of
+ * the finer grid. Returns the number of levels this rank knows about. */
+int build_levels(struct level *levels, int n, float hsq, MPI_Comm comm) {
+  int rank, n_ranks;
+  MPI_Comm_rank(comm, &rank);
+  MPI_Comm_size(comm, &n_ranks);
+  level_init(&levels[0], n, hsq, 1.0, comm, partition_start(n, rank, n_ranks), partition_count(n, rank, n_ranks));
+
+  int n_levels = 1;
+  while (n_levels < MAX_LEVELS) {
+    struct level *fine = &levels[n_levels-1];
+    struct level *coarse = &levels[n_levels];
+    if (!fine->active || fine->n < 3)
+      break;
+
+    // The last coarse point is at fine point n, or n-1 when n is odd
+    int nc = fine->n / 2;
+    float gap = fine->n % 2 == 0 ? fine->gap / 2 : (1 + fine->gap) / 2;
+    fine->coarse_offset = fine->offset / 2;
+    fine->coarse_count = (fine->offset + fine->count) / 2 - fine->coarse_offset;
+
+    // Agglomerate once any rank would have too few coarse points
+    int min_count;
+    MPI_Allreduce(&fine->coarse_count, &min_count, 1, MPI_INT, MPI_MIN, fine->comm);
+    fine->agglomerate = fine->n_ranks > 1 && min_count < MIN_LOCAL_POINTS;
+
+    if (fine->agglomerate) {
+      fine->counts = malloc(sizeof(int) * fine->n_ranks);
+      fine->displs = malloc(sizeof(int) * fine->n_ranks);
+      fine->coarse = calloc(nc+2, sizeof(*fine->coarse));
+      MPI_Allgather(&fine->coarse_count, 1, MPI_INT, fine->counts, 1, MPI_INT, fine->comm);
+      MPI_Allgather(&fine->coarse_offset, 1, MPI_INT, fine->displs, 1, MPI_INT, fine->comm);
+      if (fine->rank == 0)
+        level_init(coarse, nc, 4*fine->hsq, gap, MPI_COMM_SELF, 0, nc);
+      else
+        coarse->active = 0;
+    } else {
+      level_init(coarse, nc, 4*fine->hsq, gap, fine->comm, fine->coarse_offset, fine->coarse_count);
+    }
+    n_levels++;
+  }
+
+  return n_levels;
+}
+
+
+/* Whether this rank holds the last point of the stick on this level */
+static int owns_last_point(struct level *l) {
+  return l->count > 0 && l->offset + l->count == l->n;
+}
+
+
+/* Communicate the points at each end of this rank's part of the stick
+ * to its neighbours on this level */
+void exchange_halos(float *u, struct level *l) {
+  MPI_Sendrecv(&u[1], 1, MPI_FLOAT, l->below, 1, &u[l->count+1], 1, MPI_FLOAT, l->above, 1,
+               l->comm, MPI_STATUS_IGNORE);
+  MPI_Sendrecv(&u[l->count], 1, MPI_FLOAT, l->above, 2, &u[0], 1, MPI_FLOAT, l->below, 2,
+               l->comm, MPI_STATUS_IGNORE);
+}
+
+
+/* Apply a single time step, moving each point a fraction weight of the
+ * way to its new value. A weight of 2/3 damps the rapidly varying error
+ * that plain Jacobi (a weight of 1) leaves behind. */
+void poisson_step(
+  float *u, float *unew, float *rho,
+  float hsq, int points,
+  float weight, struct level *l
+) {
+  // Calculate one timestep
+  for (int i = 1; i <= points; i++) {
+     float difference = u[i-1] + u[i+1];
+     unew[i] = 0.5 * (difference - hsq*rho[i]);
+  }
+
+  // The last point of the stick may be nearer the boundary
+  if (owns_last_point(l) && l->gap != 1.0f) {
+     float g = l->gap;
+     unew[points] = (u[points-1] + u[points+1] / g - 0.5 * (1 + g) * hsq*rho[points]) / (1 + 1 / g);
+  }
+
+  // Overwrite u with the new field
+  for (int i = 1; i <= points; i++) {
+     u[i] += weight * (unew[i] - u[i]);
+  }
+
+  // The u field has been changed, communicate it to neighbours
+  exchange_halos(u, l);
+}
+
+
+void smooth(struct level *l, int sweeps, float weight) {
+  for (int s = 0; s < sweeps; s++)
+    poisson_step(l->u, l->unew, l->rho, l->hsq, l->count, weight, l);
+}
+
+
+/* Find how far each point is from satisfying the equation the step is
+ * solving, (u[i-1] - 2u[i] + u[i+1]) / hsq = rho[i] */
+void compute_residual(struct level *l) {
+  for (int i = 1; i <= l->count; i++)
+    l->res[i] = l->rho[i] - (l->u[i-1] - 2*l->u[i] + l->u[i+1]) / l->hsq;
+  if (owns_last_point(l) && l->gap != 1.0f) {
+    int i = l->count;
+    float g = l->gap;
+    l->res[i] = l->rho[i] - 2 / ((1 + g) * l->hsq) * ((l->u[i+1] - l->u[i]) / g - (l->u[i] - l->u[i-1]));
+  }
+  exchange_halos(l->res, l);
+}
+
+
+/* Average the residual onto the coarse points owned by this rank,
+ * weighting each coarse point's fine neighbours by a half */
+void restrict_residual(struct level *l, float *coarse_rho) {
+  for (int j = 1; j <= l->coarse_count; j++) {
+    int i = 2 * (l->coarse_offset + j) - l->offset;
+    coarse_rho[j] = 0.25 * l->res[i-1] + 0.5 * l->res[i] + 0.25 * l->res[i+1];
+  }
+}
+
+
+/* Interpolate a coarse correction onto the fine points owned by this rank
+ * and add it to u. e holds coarse points from coarse_offset onwards,
+ * including its halo. */
+void prolong_correction(struct level *l, float *e, int coarse_offset) {
+  for (int i = 1; i <= l->count; i++) {
+    int global = l->offset + i;
+    int below = global / 2 - coarse_offset, above = (global + 1) / 2 - coarse_offset;
+    l->u[i] += 0.5 * (e[below] + e[above]);
+  }
+  // With an odd number of points, the last lies between the last coarse
+  // point and a boundary 1 + gap fine spacings away, where the correction
+  // is zero
+  if (owns_last_point(l) && l->n % 2 == 1 && l->gap != 1.0f) {
+    int i = l->count;
+    int below = (l->offset + i) / 2 - coarse_offset;
+    l->u[i] += (l->gap / (1 + l->gap) - 0.5) * e[below];
+  }
+  exchange_halos(l->u, l);
+}
+
+
+/* Apply one V-cycle from level l down to the coarsest level and back */
+void vcycle(struct level *levels, int l, int n_levels) {
+  struct level *fine = &levels[l];
+
+  // Solve the coarsest level by smoothing until it has converged
+  if (l == n_levels-1) {
+    smooth(fine, COARSE_SWEEPS, 1.0);
+    return;
+  }
+
+  smooth(fine, PRE_SWEEPS, JACOBI_WEIGHT);
+  compute_residual(fine);
+
+  // The residual becomes the right hand side of the coarse level,
+  // which solves for the correction to u starting from zero
+  struct level *coarse = &levels[l+1];
+  if (fine->agglomerate) {
+    restrict_residual(fine, fine->coarse);
+    MPI_Gatherv(&fine->coarse[1], fine->coarse_count, MPI_FLOAT,
+                fine->rank == 0 ? &coarse->rho[1] : NULL, fine->counts, fine->displs, MPI_FLOAT,
+                0, fine->comm);
+  } else {
+    restrict_residual(fine, coarse->rho);
+  }
+
+  if (coarse->active) {
+    for (int i = 0; i <= coarse->count+1; i++)
+      coarse->u[i] = 0.0;
+    vcycle(levels, l+1, n_levels);
+  }
+
+  if (fine->agglomerate) {
+    // Share the whole coarse correction from rank 0
+    float *e = fine->rank == 0 ? coarse->u : fine->coarse;
+    MPI_Bcast(e, fine->n / 2 + 2, MPI_FLOAT, 0, fine->comm);
+    prolong_correction(fine, e, 0);
+  } else {
+    prolong_correction(fine, coarse->u, coarse->offset);
+  }
+
+  smooth(fine, POST_SWEEPS, JACOBI_WEIGHT);
+}
+
+
+/* For small runs, collect the stick on rank 0 and print it
+ * in the same format as poisson.c and poisson_mpi.c */
+void print_stick(struct level *l) {
+  int *counts = NULL, *displs = NULL;
+  float *resultbuf = NULL;
+
+  if (l->rank == 0) {
+    counts = malloc(sizeof(*counts) * l->n_ranks);
+    displs = malloc(sizeof(*displs) * l->n_ranks);
+    resultbuf = malloc(sizeof(*resultbuf) * l->n);
+  }
+  MPI_Gather(&l->count, 1, MPI_INT, counts, 1, MPI_INT, 0, l->comm);
+  MPI_Gather(&l->offset, 1, MPI_INT, displs, 1, MPI_INT, 0, l->comm);
+  MPI_Gatherv(&l->u[1], l->count, MPI_FLOAT, resultbuf, counts, displs, MPI_FLOAT, 0, l->comm);
+
+  if (l->rank == 0) {
+    printf("Final result:\n");
+    for (int j = 0; j < l->n; j++) {
+      printf("%d-", (int) resultbuf[j]);
+    }
+    printf("\n");
+    free(counts);
+    free(displs);
+    free(resultbuf);
+  }
+}
+
+
+int main(int argc, char** argv) {
+
+  struct level levels[MAX_LEVELS];
+  float *uprev;
+  float h, hsq;
+  double unorm, global_unorm, residual;
+  int rank, n_ranks;
+  int cycle = 0;
+
+  MPI_Init(&argc, &argv);
+  MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+  MPI_Comm_size(MPI_COMM_WORLD, &n_ranks);
+
+  int gridsize = param_long(argc, argv, "gridsize", GRIDSIZE);
+  int max_cycles = param_long(argc, argv, "max_cycles", MAX_CYCLES);
+  param_record_long("ranks", n_ranks);
+  struct benchmark bench;
+  benchmark_create(&bench, argc, argv);
+  if (rank == 0)
+    params_print_header(stdout, argv[0]);
+
+  if (gridsize < n_ranks) {
+    if (rank == 0)
+      printf("Need at least one point per rank\n");
+    MPI_Abort(MPI_COMM_WORLD, 1);
+  }
+
+  // Set up parameters
+  h = 0.1;
+  hsq = h*h;
+  residual = 1e-5;
+
+  int n_levels = build_levels(levels, gridsize, hsq, MPI_COMM_WORLD);
+  struct level *finest = &levels[0];
+  uprev = malloc(sizeof(*uprev) * (finest->count + 2));
+
+  // Every repetition solves from the same start. The coarser levels are
+  // reset by each V-cycle, so only the finest grid needs setting up.
+  while (benchmark_next(&bench)) {
+    // Initialise the u and rho field to 0
+    memset(finest->u, 0, sizeof(*finest->u) * (finest->count + 2));
+    memset(finest->unew, 0, sizeof(*finest->unew) * (finest->count + 2));
+    memset(finest->rho, 0, sizeof(*finest->rho) * (finest->count + 2));
+
+    // Create a start configuration with the heat energy
+    // u=10 at the x=0 boundary for rank 0
+    if (rank == 0)
+      finest->u[0] = 10.0;
+
+    benchmark_start(&bench, "solve");
+
+    // Run V-cycles until the field reaches an equilibrium
+    // and no longer changes
+    for (cycle = 0; cycle < max_cycles; cycle++) {
+      for (int i = 1; i <= finest->count; i++)
+        uprev[i] = finest->u[i];
+
+      vcycle(levels, 0, n_levels);
+
+      unorm = 0.0;
+      for (int i = 1; i <= finest->count; i++) {
+        float diff = finest->u[i] - uprev[i];
+        unorm += diff*diff;
+      }
+      MPI_Allreduce(&unorm, &global_unorm, 1, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+      if (sqrt(global_unorm) < sqrt(residual))
+        break;
+    }
+
+    benchmark_stop(&bench, "solve");
+  }
+  double elapsed = benchmark_stats(&bench, "solve").median;
+
+  if (gridsize <= MAX_PRINT_POINTS)
+    print_stick(finest);
+
+  if (rank == 0) {
+    int distributed = 1;
+    while (distributed < n_levels && !levels[distributed-1].agglomerate)
+      distributed++;
+    printf("Grid %d on %d ranks, %d levels down to %d points, %d agglomerated on rank 0\n",
+           gridsize, n_ranks, n_levels, levels[n_levels-1].n, n_levels - distributed);
+    printf("Run completed in %d V-cycles with residue %g\n", cycle, global_unorm);
+    printf("Time %f seconds\n", elapsed);
+  }
+  benchmark_report(&bench);
+  benchmark_destroy(&bench);
+
+  for (int l = 0; l < n_levels; l++)
+    level_free(&levels[l]);
+  free(uprev);
+
+  MPI_Finalize();
+}
@@ -0,0 +1,295 @@
+/*
+ * gemm.h - a cache blocked matrix multiplication kernel
+ *
+ * Computes C += A * B for row major matrices of doubles. gemm_blocked()
+ * packs blocks of A and B to fit in cache and multiplies them with a
+ * register blocked micro-kernel, written with AVX2, AVX-512 or plain C.
+ * Each is compiled with a target attribute, so no special flags are needed,
+ * and gemm_select("auto") picks the fastest the processor supports, e.g.
+ *
+ *   const struct gemm_kernel *kernel = gemm_select("auto");
+ *   gemm_blocked(kernel, m, n, k, a, k, b, n, c, n);
+ */
+
+#ifndef GEMM_H
+#define GEMM_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define GEMM_X86 1
+#include <immintrin.h>
+#endif
+
+/* Block sizes, in doubles, for the packed panels of A (MC x KC) and B (KC x NC) */
+#define GEMM_MC 192
+#define GEMM_KC 256
+#define GEMM_NC 4096
+
+/* The largest micro-kernel, used to size the buffer for partial blocks of C */
+#define GEMM_MR_MAX 8
+#define GEMM_NR_MAX 16
+
+/* Multiply an mr x kc sliver of packed A by a kc x nr sliver of packed B,
+ * adding the result to the mr x nr block of C with leading dimension ldc */
+typedef void (*gemm_micro_kernel)(int kc, const double *a, const double *b, double *c, int ldc);
+
+struct gemm_kernel {
+    const char *name;
+    int mr;
+    int nr;
+    gemm_micro_kernel micro;
+};
+
+#define GEMM_GENERIC_MR 4
+#define GEMM_GENERIC_NR 8
+
+static inline void gemm_micro_generic(int kc, const double *a, const double *b, double *c, int ldc)
+{
+    double ab[GEMM_GENERIC_MR][GEMM_GENERIC_NR] = {{0.0}};
+
+    for (int p = 0; p < kc; ++p) {
+        for (int i = 0; i < GEMM_GENERIC_MR; ++i) {
+            for (int j = 0; j < GEMM_GENERIC_NR; ++j) {
+                ab[i][j] += a[i] * b[j];
+            }
+        }
+        a += GEMM_GENERIC_MR;
+        b += GEMM_GENERIC_NR;
+    }
+
+    for (int i = 0; i < GEMM_GENERIC_MR; ++i) {
+        for (int j = 0; j < GEMM_GENERIC_NR; ++j) {
+            c[i * ldc + j] += ab[i][j];
+        }
+    }
+}
+
+#ifdef GEMM_X86
+
+/* 4 x 8 block of C held in eight 256-bit registers */
+__attribute__((target("avx2,fma"))) static inline void gemm_micro_avx2(int kc, const double *a, const double *b,
+                                                                       double *c, int ldc)
+{
+    __m256d c00 = _mm256_setzero_pd(), c01 = _mm256_setzero_pd();
+    __m256d c10 = _mm256_setzero_pd(), c11 = _mm256_setzero_pd();
+    __m256d c20 = _mm256_setzero_pd(), c21 = _mm256_setzero_pd();
+    __m256d c30 = _mm256_setzero_pd(), c31 = _mm256_setzero_pd();
+
+    for (int p = 0; p < kc; ++p) {
+        __m256d b0 = _mm256_loadu_pd(b);
+        __m256d b1 = _mm256_loadu_pd(b + 4);
+        __m256d ai;
+
+        ai = _mm256_broadcast_sd(a);
+        c00 = _mm256_fmadd_pd(ai, b0, c00);
+        c01 = _mm256_fmadd_pd(ai, b1, c01);
+        ai = _mm256_broadcast_sd(a + 1);
+        c10 = _mm256_fmadd_pd(ai, b0, c10);
+        c11 = _mm256_fmadd_pd(ai, b1, c11);
+        ai = _mm256_broadcast_sd(a + 2);
+        c20 = _mm256_fmadd_pd(ai, b0, c20);
+        c21 = _mm256_fmadd_pd(ai, b1, c21);
+        ai = _mm256_broadcast_sd(a + 3);
+        c30 = _mm256_fmadd_pd(ai, b0, c30);
+        c31 = _mm256_fmadd_pd(ai, b1, c31);
+
+        a += 4;
+        b += 8;
+    }
+
+    _mm256_storeu_pd(c, _mm256_add_pd(_mm256_loadu_pd(c), c00));
+    _mm256_storeu_pd(c + 4, _mm256_add_pd(_mm256_loadu_pd(c + 4), c01));
+    c += ldc;
+    _mm256_storeu_pd(c, _mm256_add_pd(_mm256_loadu_pd(c), c10));
+    _mm256_storeu_pd(c + 4, _mm256_add_pd(_mm256_loadu_pd(c + 4), c11));
+    c += ldc;
+    _mm256_storeu_pd(c, _mm256_add_pd(_mm256_loadu_pd(c), c20));
+    _mm256_storeu_pd(c + 4, _mm256_add_pd(_mm256_loadu_pd(c + 4), c21));
+    c += ldc;
+    _mm256_storeu_pd(c, _mm256_add_pd(_mm256_loadu_pd(c), c30));
+    _mm256_storeu_pd(c + 4, _mm256_add_pd(_mm256_loadu_pd(c + 4), c31));
+}
+
+/* 8 x 16 block of C held in sixteen 512-bit registers */
+__attribute__((target("avx512f"))) static inline void gemm_micro_avx512(int kc, const double *a, const double *b,
+                                                                        double *c, int ldc)
+{
+    __m512d c0[8], c1[8];
+
+    for (int i = 0; i < 8; ++i) {
+        c0[i] = _mm512_setzero_pd();
+        c1[i] = _mm512_setzero_pd();
+    }
+
+    for (int p = 0; p < kc; ++p) {
+        __m512d b0 = _mm512_loadu_pd(b);
+        __m512d b1 = _mm512_loadu_pd(b + 8);
+        for (int i = 0; i < 8; ++i) {
+            __m512d ai = _mm512_set1_pd(a[i]);
+            c0[i] = _mm512_fmadd_pd(ai, b0, c0[i]);
+            c1[i] = _mm512_fmadd_pd(ai, b1, c1[i]);
+        }
+        a += 8;
+        b += 16;
+    }
+
+    for (int i = 0; i < 8; ++i) {
+        double *row = c + i * ldc;
+        _mm512_storeu_pd(row, _mm512_add_pd(_mm512_loadu_pd(row), c0[i]));
+        _mm512_storeu_pd(row + 8, _mm512_add_pd(_mm512_loadu_pd(row + 8), c1[i]));
+    }
+}
+
+#endif
+
+static const struct gemm_kernel gemm_kernels[] = {
+#ifdef GEMM_X86
+    {"avx512", 8, 16, gemm_micro_avx512},
+    {"avx2", 4, 8, gemm_micro_avx2},
+#endif
+    {"generic", GEMM_GENERIC_MR, GEMM_GENERIC_NR, gemm_micro_generic},
+};
+
+#define GEMM_NUM_KERNELS (int)(sizeof(gemm_kernels) / sizeof(gemm_kernels[0]))
+
+/* Check whether the processor we are running on can execute a kernel */
+static inline int gemm_kernel_supported(const struct gemm_kernel *kernel)
+{
+#ifdef GEMM_X86
+    __builtin_cpu_init();
+    if (strcmp(kernel->name, "avx512") == 0) {
+        return __builtin_cpu_supports("avx512f");
+    }
+    if (strcmp(kernel->name, "avx2") == 0) {
+        return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    }
+#endif
+    return 1;
+}
+
+/* Find a kernel by name, or the fastest supported one for "auto". Returns
+ * NULL if there is no such kernel or this processor can't run it. */
+static inline const struct gemm_kernel *gemm_select(const char *name)
+{
+    for (int i = 0; i < GEMM_NUM_KERNELS; ++i) {
+        const struct gemm_kernel *kernel = &gemm_kernels[i];
+        if ((strcmp(name, "auto") == 0 || strcmp(name, kernel->name) == 0) && gemm_kernel_supported(kernel)) {
+            return kernel;
+        }
+    }
+    return NULL;
+}
+
+/* Copy an mc x kc block of A into slivers of mr rows, stored column by
+ * column, padding the last sliver with zeros */
+static inline void gemm_pack_a(int mc, int kc, const double *a, int lda, int mr, double *packed)
+{
+    for (int i0 = 0; i0 < mc; i0 += mr) {
+        for (int p = 0; p < kc; ++p) {
+            for (int i = i0; i < i0 + mr; ++i) {
+                *packed++ = i < mc ? a[i * lda + p] : 0.0;
+            }
+        }
+    }
+}
+
+/* Copy a kc x nc panel of B into slivers of nr columns, stored row by row,
+ * padding the last sliver with zeros */
+static inline void gemm_pack_b(int kc, int nc, const double *b, int ldb, int nr, double *packed)
+{
+    for (int j0 = 0; j0 < nc; j0 += nr) {
+        for (int p = 0; p < kc; ++p) {
+            const double *row = b + p * ldb;
+            for (int j = j0; j < j0 + nr; ++j) {
+                *packed++ = j < nc ? row[j] : 0.0;
+            }
+        }
+    }
+}
+
+/* Allocate a cache line aligned buffer for the packed panels */
+static inline double *gemm_alloc(size_t count)
+{
+    size_t bytes = (count * sizeof(double) + 63) / 64 * 64;
+    double *buffer = aligned_alloc(64, bytes);
+    if (buffer == NULL) {
+        fprintf(stderr, "Could not allocate %zu bytes for matrix panels\n", bytes);
+        exit(EXIT_FAILURE);
+    }
+    return buffer;
+}
+
+/* The number of doubles of workspace gemm_blocked_workspace() needs for
+ * the packed blocks of A, followed by the packed panels of B */
+static inline size_t gemm_workspace_size(const struct gemm_kernel *kernel)
+{
+    size_t mc_max = (GEMM_MC + kernel->mr - 1) / kernel->mr * kernel->mr;
+    size_t nc_max = (GEMM_NC + kernel->nr - 1) / kernel->nr * kernel->nr;
+    return (mc_max + nc_max) * GEMM_KC;
+}
+
+/* C += A * B, where A is m x k, B is k x n and C is m x n, packing into a
+ * workspace of gemm_workspace_size() doubles, so that repeated calls can
+ * reuse the same memory */
+static inline void gemm_blocked_workspace(const struct gemm_kernel *kernel, int m, int n, int k, const double *a,
+                                          int lda, const double *b, int ldb, double *c, int ldc, double *workspace)
+{
+    const int mr = kernel->mr;
+    const int nr = kernel->nr;
+    const int mc_max = (GEMM_MC + mr - 1) / mr * mr;
+    double *packed_a = workspace;
+    double *packed_b = workspace + (size_t)mc_max * GEMM_KC;
+    double partial[GEMM_MR_MAX * GEMM_NR_MAX];
+
+    for (int j0 = 0; j0 < n; j0 += GEMM_NC) {
+        int nc = n - j0 < GEMM_NC ? n - j0 : GEMM_NC;
+
+        for (int p0 = 0; p0 < k; p0 += GEMM_KC) {
+            int kc = k - p0 < GEMM_KC ? k - p0 : GEMM_KC;
+            gemm_pack_b(kc, nc, b + p0 * ldb + j0, ldb, nr, packed_b);
+
+            for (int i0 = 0; i0 < m; i0 += GEMM_MC) {
+                int mc = m - i0 < GEMM_MC ? m - i0 : GEMM_MC;
+                gemm_pack_a(mc, kc, a + i0 * lda + p0, lda, mr, packed_a);
+
+                for (int jr = 0; jr < nc; jr += nr) {
+                    const double *sliver_b = packed_b + (size_t)jr * kc;
+
+                    for (int ir = 0; ir < mc; ir += mr) {
+                        const double *sliver_a = packed_a + (size_t)ir * kc;
+                        double *block = c + (i0 + ir) * ldc + j0 + jr;
+
+                        if (ir + mr <= mc && jr + nr <= nc) {
+                            kernel->micro(kc, sliver_a, sliver_b, block, ldc);
+                        } else {
+                            /* At the edges of C, work on a full sized copy of the block */
+                            int rows = mc - ir < mr ? mc - ir : mr;
+                            int cols = nc - jr < nr ? nc - jr : nr;
+                            memset(partial, 0, sizeof(partial));
+                            kernel->micro(kc, sliver_a, sliver_b, partial, nr);
+                            for (int i = 0; i < rows; ++i) {
+                                for (int j = 0; j < cols; ++j) {
+                                    block[i * ldc + j] += partial[i * nr + j];
+                                }
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+/* C += A * B, with a workspace allocated for just this call */
+static inline void gemm_blocked(const struct gemm_kernel *kernel, int m, int n, int k, const double *a, int lda,
+                                const double *b, int ldb, double *c, int ldc)
+{
+    double *workspace = gemm_alloc(gemm_workspace_size(kernel));
+    gemm_blocked_workspace(kernel, m, n, k, a, lda, b, ldb, c, ldc, workspace);
+    free(workspace);
+}
+
+#endif
@@ -0,0 +1,200 @@
+/*
+ * halo_array.h - describing arrays with ghost cells, and the MPI datatypes
+ * for their faces
+ *
+ * A struct halo_array holds the layout of an N dimensional array: the
+ * points each rank owns, the width of the ghost layer in each dimension,
+ * and optional padding of the last dimension to a multiple of pad_to
+ * elements. A region is picked by a direction in each dimension, -1, 0 or
+ * +1, with HALO_OWNED for the owned points next to that side, which are
+ * sent, or HALO_GHOST for the ghost points beyond it, which are received.
+ * Its datatype is made the first time it's asked for and kept until
+ * halo_array_free(), and works for any buffer with the same layout, e.g.
+ *
+ *   struct halo_array layout;
+ *   int extents[2] = {rows, cols}, ghost[2] = {1, 1};
+ *   halo_array_create(&layout, 2, extents, ghost, 16, sizeof(float), MPI_FLOAT);
+ *   float **u = halo_array_alloc(&layout);
+ *   ...
+ *   halo_array_exchange(&layout, halo_array_data(&layout, u), comm, below, above);
+ */
+
+#ifndef HALO_ARRAY_H
+#define HALO_ARRAY_H
+
+#include <mpi.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "arralloc_aligned.h"
+
+#define HALO_ARRAY_MAX_DIMS 4
+/* 3^HALO_ARRAY_MAX_DIMS directions for each kind of region */
+#define HALO_ARRAY_MAX_REGIONS 81
+
+enum halo_region { HALO_OWNED, HALO_GHOST };
+
+struct halo_array {
+    int ndim;
+    int extents[HALO_ARRAY_MAX_DIMS];   /* owned points */
+    int ghost[HALO_ARRAY_MAX_DIMS];     /* ghost points on each side */
+    int allocated[HALO_ARRAY_MAX_DIMS]; /* points stored, including ghosts and padding */
+    size_t strides[HALO_ARRAY_MAX_DIMS];
+    size_t size;                        /* elements stored */
+    size_t element_size;
+    MPI_Datatype element_type;
+    MPI_Datatype types[2][HALO_ARRAY_MAX_REGIONS];
+};
+
+static inline void halo_array_create(struct halo_array *layout, int ndim, const int *extents, const int *ghost,
+                                     int pad_to, size_t element_size, MPI_Datatype element_type)
+{
+    if (ndim < 1 || ndim > HALO_ARRAY_MAX_DIMS) {
+        fprintf(stderr, "Halo arrays must have between 1 and %d dimensions\n", HALO_ARRAY_MAX_DIMS);
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+
+    layout->ndim = ndim;
+    layout->element_size = element_size;
+    layout->element_type = element_type;
+    for (int d = 0; d < ndim; ++d) {
+        layout->extents[d] = extents[d];
+        layout->ghost[d] = ghost[d];
+        layout->allocated[d] = extents[d] + 2 * ghost[d];
+    }
+    if (pad_to > 1) {
+        layout->allocated[ndim - 1] = (layout->allocated[ndim - 1] + pad_to - 1) / pad_to * pad_to;
+    }
+
+    layout->strides[ndim - 1] = 1;
+    for (int d = ndim - 2; d >= 0; --d) {
+        layout->strides[d] = layout->strides[d + 1] * layout->allocated[d + 1];
+    }
+    layout->size = layout->strides[0] * layout->allocated[0];
+
+    for (int kind = 0; kind < 2; ++kind) {
+        for (int r = 0; r < HALO_ARRAY_MAX_REGIONS; ++r) {
+            layout->types[kind][r] = MPI_DATATYPE_NULL;
+        }
+    }
+}
+
+static inline void halo_array_free(struct halo_array *layout)
+{
+    for (int kind = 0; kind < 2; ++kind) {
+        for (int r = 0; r < HALO_ARRAY_MAX_REGIONS; ++r) {
+            if (layout->types[kind][r] != MPI_DATATYPE_NULL) {
+                MPI_Type_free(&layout->types[kind][r]);
+            }
+        }
+    }
+}
+
+/* Allocate a zeroed, cache aligned array with this layout. It can be
+ * indexed with ndim subscripts, counting the ghost points, and must be
+ * released with arrfree(). */
+static inline void *halo_array_alloc(const struct halo_array *layout)
+{
+    size_t extents[HALO_ARRAY_MAX_DIMS];
+    for (int d = 0; d < layout->ndim; ++d) {
+        extents[d] = layout->allocated[d];
+    }
+
+    void *array = arralloc_aligned(layout->element_size, layout->ndim, extents, 0, ARRALLOC_FIRST_TOUCH);
+    if (array == NULL) {
+        fprintf(stderr, "Could not allocate a halo array of %zu elements\n", layout->size);
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+    return array;
+}
+
+/* The contiguous storage of an array from halo_array_alloc() */
+static inline void *halo_array_data(const struct halo_array *layout, void *array)
+{
+    return arralloc_data(array, layout->ndim);
+}
+
+/* The offset in elements of an owned point, where index 0 is the first
+ * owned point and -1 the ghost point before it */
+static inline size_t halo_array_offset(const struct halo_array *layout, const int *index)
+{
+    size_t offset = 0;
+    for (int d = 0; d < layout->ndim; ++d) {
+        offset += (size_t)(index[d] + layout->ghost[d]) * layout->strides[d];
+    }
+    return offset;
+}
+
+/* The datatype for the region in the given direction, made the first time
+ * it is needed. Returns MPI_DATATYPE_NULL for a direction in a dimension
+ * with no ghost points. */
+static inline MPI_Datatype halo_array_region(struct halo_array *layout, enum halo_region kind, const int *direction)
+{
+    int region = 0;
+    for (int d = layout->ndim - 1; d >= 0; --d) {
+        if (direction[d] != 0 && layout->ghost[d] == 0) {
+            return MPI_DATATYPE_NULL;
+        }
+        region = region * 3 + direction[d] + 1;
+    }
+
+    MPI_Datatype *type = &layout->types[kind][region];
+    if (*type == MPI_DATATYPE_NULL) {
+        int subsizes[HALO_ARRAY_MAX_DIMS], starts[HALO_ARRAY_MAX_DIMS];
+        for (int d = 0; d < layout->ndim; ++d) {
+            int ghost = layout->ghost[d];
+            if (direction[d] == 0) {
+                subsizes[d] = layout->extents[d];
+                starts[d] = ghost;
+            } else {
+                subsizes[d] = ghost;
+                if (kind == HALO_OWNED) {
+                    starts[d] = direction[d] < 0 ? ghost : layout->extents[d];
+                } else {
+                    starts[d] = direction[d] < 0 ? 0 : ghost + layout->extents[d];
+                }
+            }
+        }
+        MPI_Type_create_subarray(layout->ndim, layout->allocated, subsizes, starts, MPI_ORDER_C,
+                                 layout->element_type, type);
+        MPI_Type_commit(type);
+    }
+    return *type;
+}
+
+/* The datatype for one face: side -1 or +1 in dimension dim */
+static inline MPI_Datatype halo_array_face(struct halo_array *layout, enum halo_region kind, int dim, int side)
+{
+    int direction[HALO_ARRAY_MAX_DIMS] = {0};
+    direction[dim] = side;
+    return halo_array_region(layout, kind, direction);
+}
+
+/* The datatype for all of the owned points, without the ghosts */
+static inline MPI_Datatype halo_array_interior(struct halo_array *layout)
+{
+    int direction[HALO_ARRAY_MAX_DIMS] = {0};
+    return halo_array_region(layout, HALO_OWNED, direction);
+}
+
+/* Fill the ghost faces of data from the neighbouring ranks, below[d] and
+ * above[d] in each dimension with ghost points, which may be
+ * MPI_PROC_NULL at the edges of the domain. Only faces are exchanged, so
+ * the ghost edges and corners are not filled, which is all a stencil
+ * without diagonal neighbours needs. */
+static inline void halo_array_exchange(struct halo_array *layout, void *data, MPI_Comm comm, const int *below,
+                                       const int *above)
+{
+    for (int d = 0; d < layout->ndim; ++d) {
+        if (layout->ghost[d] == 0) {
+            continue;
+        }
+        /* Send our low face down while receiving our high ghosts from above, then the reverse */
+        MPI_Sendrecv(data, 1, halo_array_face(layout, HALO_OWNED, d, -1), below[d], 2 * d, data, 1,
+                     halo_array_face(layout, HALO_GHOST, d, +1), above[d], 2 * d, comm, MPI_STATUS_IGNORE);
+        MPI_Sendrecv(data, 1, halo_array_face(layout, HALO_OWNED, d, +1), above[d], 2 * d + 1, data, 1,
+                     halo_array_face(layout, HALO_GHOST, d, -1), below[d], 2 * d + 1, comm, MPI_STATUS_IGNORE);
+    }
+}
+
+#endif
@@ -0,0 +1,334 @@
+/*
+ * Distributed matrix multiplication, C = A B, using SUMMA (the Scalable
+ * Universal Matrix Multiplication Algorithm).
+ *
+ * matrix-multiply.c gives every rank a copy of the whole of B, so the memory
+ * each rank needs doesn't shrink as we add ranks. Here the ranks are arranged
+ * in a two dimensional grid and A, B and C are all divided between them in a
+ * block-cyclic pattern: the matrices are cut into nb x nb blocks, and block
+ * (I, J) belongs to the rank at grid position (I mod rows, J mod cols). Each
+ * rank only ever holds its own share of the matrices, plus two panels of nb
+ * columns of A and nb rows of B, so with P ranks the memory per rank is
+ * O(N^2 / P) and we can multiply matrices too large for any one node.
+ *
+ * For each block of nb along the inner dimension k, the ranks owning that
+ * block column of A broadcast it along their grid row, and the ranks owning
+ * that block row of B broadcast it down their grid column. Every rank then
+ * adds the product of the two panels to its part of C. The broadcasts for
+ * the next panel are started before multiplying the current one, so they
+ * can proceed while we compute.
+ *
+ * The matrices are filled with pseudo-random values computed from their
+ * global indices, so each rank can create its own part without any
+ * communication. The result is checked by comparing C x with A (B x) for a
+ * random vector x, which only needs matrix-vector products.
+ *
+ * Usage: mpirun -n <ranks> matrix-multiply-summa [--a-rows m] [--a-cols k] [--b-cols n]
+ *                                               [--block-size nb] [--kernel name]
+ *                                               [--warmup w] [--repetitions r] [--results file]
+ */
+
+#include <math.h>
+#include <mpi.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "benchmark.h"
+#include "gemm.h"
+#include "params.h"
+
+#define ROOT_RANK 0
+
+struct process_grid {
+    MPI_Comm comm;
+    MPI_Comm row_comm; /* the ranks in the same grid row, ranked by column */
+    MPI_Comm col_comm; /* the ranks in the same grid column, ranked by row */
+    int dims[2];
+    int coords[2];
+};
+
+void create_grid(struct process_grid *grid)
+{
+    int num_ranks;
+    int periods[2] = {0, 0};
+    int keep_cols[2] = {0, 1};
+    int keep_rows[2] = {1, 0};
+    int my_rank;
+
+    MPI_Comm_size(MPI_COMM_WORLD, &num_ranks);
+    grid->dims[0] = grid->dims[1] = 0;
+    MPI_Dims_create(num_ranks, 2, grid->dims);
+    MPI_Cart_create(MPI_COMM_WORLD, 2, grid->dims, periods, 1, &grid->comm);
+    MPI_Comm_rank(grid->comm, &my_rank);
+    MPI_Cart_coords(grid->comm, my_rank, 2, grid->coords);
+    MPI_Cart_sub(grid->comm, keep_cols, &grid->row_comm);
+    MPI_Cart_sub(grid->comm, keep_rows, &grid->col_comm);
+}
+
+void free_grid(struct process_grid *grid)
+{
+    MPI_Comm_free(&grid->row_comm);
+    MPI_Comm_free(&grid->col_comm);
+    MPI_Comm_free(&grid->comm);
+}
+
+/* The number of the n rows (or columns) that process p of num_procs owns,
+ * when they are dealt out in blocks of nb */
+int local_size(int n, int nb, int p, int num_procs)
+{
+    int num_blocks = (n + nb - 1) / nb;
+    int size = (num_blocks / num_procs + (p < num_blocks % num_procs ? 1 : 0)) * nb;
+
+    /* The last block may be only partly full */
+    if (num_blocks > 0 && (num_blocks - 1) % num_procs == p) {
+        size -= num_blocks * nb - n;
+    }
+    return size;
+}
+
+/* The global index of local row (or column) l of process p */
+int global_index(int l, int nb, int p, int num_procs)
+{
+    return ((l / nb) * num_procs + p) * nb + l % nb;
+}
+
+/* A pseudo-random value in [0, 1) for element (i, j), from the splitmix64 hash */
+double matrix_entry(uint64_t seed, long i, long j)
+{
+    uint64_t z = seed + 0x9e3779b97f4a7c15ULL * ((uint64_t)i * 0x100000001ULL + (uint64_t)j + 1);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    z = z ^ (z >> 31);
+    return (z >> 11) * 0x1.0p-53;
+}
+
+/* Allocate count doubles, or abort. A rank's block is empty when the grid
+ * has more rows or columns than the matrix has blocks, and it then gets
+ * NULL, which is never read or written through. */
+double *allocate_doubles(size_t count, const char *what)
+{
+    if (count == 0) {
+        return NULL;
+    }
+    double *values = malloc(count * sizeof(double));
+    if (values == NULL) {
+        printf("Could not allocate %zu values for %s\n", count, what);
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+    return values;
+}
+
+/* Allocate and fill this rank's part of a rows x cols matrix */
+double *create_local_matrix(uint64_t seed, int rows, int cols, int nb, const struct process_grid *grid,
+                            int *local_rows, int *local_cols)
+{
+    *local_rows = local_size(rows, nb, grid->coords[0], grid->dims[0]);
+    *local_cols = local_size(cols, nb, grid->coords[1], grid->dims[1]);
+
+    double *matrix = allocate_doubles((size_t)*local_rows * *local_cols, "a local matrix");
+    for (int i = 0; i < *local_rows; ++i) {
+        int global_i = global_index(i, nb, grid->coords[0], grid->dims[0]);
+        for (int j = 0; j < *local_cols; ++j) {
+            int global_j = global_index(j, nb, grid->coords[1], grid->dims[1]);
+            matrix[(size_t)i * *local_cols + j] = matrix_entry(seed, global_i, global_j);
+        }
+    }
+    return matrix;
+}
+
+/* Start broadcasting the panels for block p of the inner dimension: the
+ * block column of A along each grid row, and the block row of B down each
+ * grid column */
+void start_panel_broadcast(int p, int k, int nb, const struct process_grid *grid, const double *local_a,
+                           int local_m, int local_ka, const double *local_b, int local_n, double *a_panel,
+                           double *b_panel, MPI_Request requests[2])
+{
+    int width = k - p * nb < nb ? k - p * nb : nb;
+    int a_owner = p % grid->dims[1];
+    int b_owner = p % grid->dims[0];
+
+    if (grid->coords[1] == a_owner) {
+        int offset = (p / grid->dims[1]) * nb;
+        for (int i = 0; i < local_m; ++i) {
+            memcpy(a_panel + (size_t)i * width, local_a + (size_t)i * local_ka + offset, width * sizeof(double));
+        }
+    }
+    if (grid->coords[0] == b_owner && local_n > 0) {
+        int offset = (p / grid->dims[0]) * nb;
+        memcpy(b_panel, local_b + (size_t)offset * local_n, (size_t)width * local_n * sizeof(double));
+    }
+
+    MPI_Ibcast(a_panel, local_m * width, MPI_DOUBLE, a_owner, grid->row_comm, &requests[0]);
+    MPI_Ibcast(b_panel, width * local_n, MPI_DOUBLE, b_owner, grid->col_comm, &requests[1]);
+}
+
+/* The arena space summa() needs for its panels and the kernel's workspace */
+size_t summa_buffer_size(const struct gemm_kernel *kernel, int nb, int local_m, int local_n)
+{
+    return 2 * ARENA_SIZE((size_t)local_m * nb * sizeof(double)) +
+           2 * ARENA_SIZE((size_t)nb * local_n * sizeof(double)) +
+           ARENA_SIZE(gemm_workspace_size(kernel) * sizeof(double));
+}
+
+/* local_c += the local part of A B, using double buffered panels so the
+ * next broadcast overlaps with the current multiplication. The panels
+ * and workspace are taken from the arena and given back at the end. */
+void summa(const struct gemm_kernel *kernel, int k, int nb, const struct process_grid *grid, const double *local_a,
+           int local_m, int local_ka, const double *local_b, int local_n, double *local_c, struct arena *buffers)
+{
+    int num_panels = (k + nb - 1) / nb;
+    double *a_panel[2], *b_panel[2];
+    MPI_Request requests[2][2];
+    size_t mark = arena_mark(buffers);
+
+    for (int b = 0; b < 2; ++b) {
+        a_panel[b] = arena_alloc(buffers, (size_t)local_m * nb * sizeof(double));
+        b_panel[b] = arena_alloc(buffers, (size_t)nb * local_n * sizeof(double));
+    }
+    double *workspace = arena_alloc(buffers, gemm_workspace_size(kernel) * sizeof(double));
+
+    start_panel_broadcast(0, k, nb, grid, local_a, local_m, local_ka, local_b, local_n, a_panel[0], b_panel[0],
+                          requests[0]);
+
+    for (int p = 0; p < num_panels; ++p) {
+        int current = p % 2;
+        int width = k - p * nb < nb ? k - p * nb : nb;
+
+        if (p + 1 < num_panels) {
+            int next = (p + 1) % 2;
+            start_panel_broadcast(p + 1, k, nb, grid, local_a, local_m, local_ka, local_b, local_n,
+                                  a_panel[next], b_panel[next], requests[next]);
+        }
+
+        MPI_Waitall(2, requests[current], MPI_STATUSES_IGNORE);
+        gemm_blocked_workspace(kernel, local_m, local_n, width, a_panel[current], width, b_panel[current], local_n,
+                               local_c, local_n, workspace);
+    }
+
+    arena_release(buffers, mark);
+}
+
+/* y = M x for a distributed rows x cols matrix M, where x is the full vector
+ * and every rank receives the full result */
+void multiply_vector(const double *local_matrix, int local_rows, int local_cols, int rows, int nb,
+                     const struct process_grid *grid, const double *x, double *y)
+{
+    memset(y, 0, rows * sizeof(double));
+    for (int i = 0; i < local_rows; ++i) {
+        double sum = 0.0;
+        for (int j = 0; j < local_cols; ++j) {
+            sum += local_matrix[(size_t)i * local_cols + j] * x[global_index(j, nb, grid->coords[1], grid->dims[1])];
+        }
+        y[global_index(i, nb, grid->coords[0], grid->dims[0])] = sum;
+    }
+    MPI_Allreduce(MPI_IN_PLACE, y, rows, MPI_DOUBLE, MPI_SUM, grid->comm);
+}
+
+int main(int argc, char **argv)
+{
+    int my_rank;
+    int num_ranks;
+    struct process_grid grid;
+
+    MPI_Init(&argc, &argv);
+    MPI_Comm_size(MPI_COMM_WORLD, &num_ranks);
+
+    struct benchmark bench;
+    benchmark_create(&bench, argc, argv);
+    const int a_rows = param_long(argc, argv, "a_rows", 1024);
+    const int a_cols = param_long(argc, argv, "a_cols", 1024);
+    const int b_cols = param_long(argc, argv, "b_cols", 1024);
+    const int nb = param_long(argc, argv, "block_size", 128);
+    const char *kernel_name = param_string(argc, argv, "kernel", "auto");
+    /* --alloc-mem 0 takes the panels from the heap instead of MPI_Alloc_mem */
+    const int alloc_mem = param_long(argc, argv, "alloc_mem", 1);
+    param_record_long("ranks", num_ranks);
+
+    create_grid(&grid);
+    MPI_Comm_rank(grid.comm, &my_rank);
+
+    const struct gemm_kernel *kernel = gemm_select(kernel_name);
+    if (kernel == NULL || nb < 1) {
+        if (my_rank == ROOT_RANK) {
+            printf(kernel == NULL ? "Kernel %s is unknown or not supported by this processor\n"
+                                  : "The block size must be positive\n",
+                   kernel_name);
+        }
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+    param_record("kernel_selected", kernel->name, PARAM_STRING);
+    if (my_rank == ROOT_RANK) {
+        params_print_header(stdout, argv[0]);
+    }
+
+    /* Each rank creates only its own blocks of A and B */
+    int local_m, local_ka, local_kb, local_n;
+    double *local_a = create_local_matrix(1, a_rows, a_cols, nb, &grid, &local_m, &local_ka);
+    double *local_b = create_local_matrix(2, a_cols, b_cols, nb, &grid, &local_kb, &local_n);
+    double *local_c = allocate_doubles((size_t)local_m * local_n, "the local part of C");
+
+    struct arena buffers;
+    arena_create(&buffers, summa_buffer_size(kernel, nb, local_m, local_n), alloc_mem ? ARENA_MPI_MEMORY : 0);
+
+    /* summa() adds to C, so it starts from zero every run */
+    while (benchmark_next(&bench)) {
+        if (local_c != NULL) {
+            memset(local_c, 0, (size_t)local_m * local_n * sizeof(double));
+        }
+        benchmark_start(&bench, "summa");
+        summa(kernel, a_cols, nb, &grid, local_a, local_m, local_ka, local_b, local_n, local_c, &buffers);
+        benchmark_stop(&bench, "summa");
+    }
+    double elapsed = benchmark_stats(&bench, "summa").median;
+
+    /* Memory for the local matrices, and the most used of the arena for
+     * the panels and the kernel's workspace */
+    double local_bytes = sizeof(double) * ((double)local_m * local_ka + (double)local_kb * local_n +
+                                           (double)local_m * local_n) +
+                         buffers.high_water;
+    MPI_Allreduce(MPI_IN_PLACE, &local_bytes, 1, MPI_DOUBLE, MPI_MAX, grid.comm);
+
+    /* Check C x against A (B x) */
+    double *x = allocate_doubles(b_cols, "the test vector");
+    double *bx = allocate_doubles(a_cols, "B x");
+    double *abx = allocate_doubles(a_rows, "A (B x)");
+    double *cx = allocate_doubles(a_rows, "C x");
+    for (int j = 0; j < b_cols; ++j) {
+        x[j] = matrix_entry(3, 0, j);
+    }
+    multiply_vector(local_b, local_kb, local_n, a_cols, nb, &grid, x, bx);
+    multiply_vector(local_a, local_m, local_ka, a_rows, nb, &grid, bx, abx);
+    multiply_vector(local_c, local_m, local_n, a_rows, nb, &grid, x, cx);
+
+    double max_difference = 0.0, max_value = 0.0;
+    for (int i = 0; i < a_rows; ++i) {
+        max_difference = fmax(max_difference, fabs(cx[i] - abx[i]));
+        max_value = fmax(max_value, fabs(abx[i]));
+    }
+
+    if (my_rank == ROOT_RANK) {
+        printf("Multiplied %d x %d by %d x %d on a %d x %d grid with block size %d\n", a_rows, a_cols, a_cols, b_cols,
+               grid.dims[0], grid.dims[1], nb);
+        printf("Time %f seconds, %.2f GFLOP/s\n", elapsed, 2.0 * a_rows * a_cols * b_cols / elapsed / 1e9);
+        printf("Largest memory per rank %.1f MB\n", local_bytes / 1e6);
+        printf("Relative error of C x against A (B x): %g\n", max_value > 0.0 ? max_difference / max_value : 0.0);
+    }
+    arena_report(&buffers, "panels", grid.comm);
+    benchmark_report(&bench);
+    benchmark_destroy(&bench);
+
+    free(x);
+    free(bx);
+    free(abx);
+    free(cx);
+    free(local_a);
+    free(local_b);
+    free(local_c);
+    arena_destroy(&buffers);
+    free_grid(&grid);
+
+    return MPI_Finalize();
+}
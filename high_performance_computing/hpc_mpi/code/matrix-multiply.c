@@ -2,15 +2,30 @@
 #include <mpi.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 
+#include "arena.h"
+#include "benchmark.h"
+#include "gemm.h"
+#include "params.h"
+#include "partition.h"
+
 #define N 4
 #define M 4
 #define NUM_ELEMENTS (N * M)
 #define ROOT_RANK 0
 
-int multiply_matrix(double *local_a, double *matrix_b, double *local_result, int a_rows, int a_cols, int b_cols,
-                    int rows_per_rank, int my_rank)
+/* The kernel used by multiply_matrix(), chosen at run time with --kernel */
+static const struct gemm_kernel *selected_kernel;
+
+/* Space for the kernel to pack blocks of the matrices into, allocated once
+ * so repeated multiplications don't go back to the heap */
+static double *gemm_workspace;
+
+/* The original triple loop, kept to check the results of the faster kernels */
+int multiply_matrix_reference(double *local_a, double *matrix_b, double *local_result, int a_rows, int a_cols,
+                              int b_cols, int rows_per_rank, int my_rank)
 {
     for (int i = 0; i < rows_per_rank; ++i) {
         for (int j = 0; j < b_cols; ++j) {
@@ -23,6 +38,96 @@ int multiply_matrix(double *local_a, double *matrix_b, double *local_result, int
     return EXIT_SUCCESS;
 }
 
+int multiply_matrix(double *local_a, double *matrix_b, double *local_result, int a_rows, int a_cols, int b_cols,
+                    int rows_per_rank, int my_rank)
+{
+    if (selected_kernel == NULL) {
+        return multiply_matrix_reference(local_a, matrix_b, local_result, a_rows, a_cols, b_cols, rows_per_rank,
+                                         my_rank);
+    }
+
+    gemm_blocked_workspace(selected_kernel, rows_per_rank, b_cols, a_cols, local_a, a_cols, matrix_b, b_cols,
+                           local_result, b_cols, gemm_workspace);
+
+    return EXIT_SUCCESS;
+}
+
+/* Measure the speed of the local multiplication for square matrices from
+ * min_size to max_size, doubling each time. The reference loop is only timed
+ * up to reference_max, as it becomes very slow for large matrices, and is
+ * used to check the result of the selected kernel. Every rank times its own
+ * multiplications, so run on one rank to time a core on its own. Each size
+ * is a separate benchmark, with the size recorded as a parameter, so
+ * --results collects a line per size. */
+void benchmark_multiply(int argc, char **argv, int min_size, int max_size, int reference_max, int my_rank)
+{
+    const char *name = selected_kernel ? selected_kernel->name : "reference";
+
+    if (my_rank == ROOT_RANK) {
+        printf("%8s %16s %16s %14s\n", "size", "reference GF/s", name, "max difference");
+    }
+
+    for (int n = min_size; n <= max_size; n *= 2) {
+        double *a = malloc((size_t)n * n * sizeof(double));
+        double *b = malloc((size_t)n * n * sizeof(double));
+        double *c = malloc((size_t)n * n * sizeof(double));
+        double *check = n <= reference_max ? malloc((size_t)n * n * sizeof(double)) : NULL;
+        double flops = 2.0 * n * n * n;
+
+        if (a == NULL || b == NULL || c == NULL || (n <= reference_max && check == NULL)) {
+            printf("Could not allocate matrices of size %d\n", n);
+            PMPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+        }
+        for (size_t i = 0; i < (size_t)n * n; ++i) {
+            a[i] = (double)rand() / RAND_MAX;
+            b[i] = (double)rand() / RAND_MAX;
+        }
+
+        struct benchmark bench;
+        benchmark_create(&bench, argc, argv);
+        param_record_long("size", n);
+        /* Both multiplications add to their result, so it starts from zero
+         * every run */
+        while (benchmark_next(&bench)) {
+            memset(c, 0, (size_t)n * n * sizeof(double));
+            benchmark_start(&bench, "kernel");
+            multiply_matrix(a, b, c, n, n, n, n, ROOT_RANK);
+            benchmark_stop(&bench, "kernel");
+
+            if (check != NULL) {
+                memset(check, 0, (size_t)n * n * sizeof(double));
+                benchmark_start(&bench, "reference");
+                multiply_matrix_reference(a, b, check, n, n, n, n, ROOT_RANK);
+                benchmark_stop(&bench, "reference");
+            }
+        }
+        double gflops = flops / benchmark_stats(&bench, "kernel").median / 1e9;
+
+        if (my_rank == ROOT_RANK) {
+            if (check != NULL) {
+                double reference_gflops = flops / benchmark_stats(&bench, "reference").median / 1e9;
+                double max_difference = 0.0;
+                for (size_t i = 0; i < (size_t)n * n; ++i) {
+                    max_difference = fmax(max_difference, fabs(c[i] - check[i]));
+                }
+                printf("%8d %16.2f %16.2f %14.3g\n", n, reference_gflops, gflops, max_difference);
+            } else {
+                printf("%8d %16s %16.2f %14s\n", n, "-", gflops, "-");
+            }
+            fflush(stdout);
+            if (bench.results[0] != '\0') {
+                benchmark_write_results(&bench);
+            }
+        }
+        benchmark_destroy(&bench);
+
+        free(a);
+        free(b);
+        free(c);
+        free(check);
+    }
+}
+
 int main(int argc, char **argv)
 {
     int my_rank;
@@ -32,21 +137,69 @@ int main(int argc, char **argv)
     MPI_Comm_size(MPI_COMM_WORLD, &num_ranks);
     srand(time(NULL));
 
-    double *matrix_a;
+    double *matrix_a = NULL;
     double *matrix_b;
-    double *matrix_result;
+    double *matrix_result = NULL;
+
+    /* The matrix shapes can be changed at run time, e.g. --a-rows 1000, see params.h */
+    const int a_rows = param_long(argc, argv, "a_rows", 10);
+    const int a_cols = param_long(argc, argv, "a_cols", 7);
+    const int b_rows = param_long(argc, argv, "b_rows", 7);
+    const int b_cols = param_long(argc, argv, "b_cols", 12);
+    /* --kernel reference|generic|avx2|avx512 overrides the fastest one for this processor */
+    const char *kernel_name = param_string(argc, argv, "kernel", "auto");
+    /* --benchmark times the local multiplication on its own for a range of sizes */
+    const int benchmark = param_long(argc, argv, "benchmark", 0);
+    const int min_size = param_long(argc, argv, "min_size", 64);
+    const int max_size = param_long(argc, argv, "max_size", 8192);
+    const int reference_max = param_long(argc, argv, "reference_max", 1024);
+    /* --alloc-mem 0 takes this rank's buffers from the heap instead of MPI_Alloc_mem */
+    const int alloc_mem = param_long(argc, argv, "alloc_mem", 1);
+    param_record_long("ranks", num_ranks);
+    struct benchmark bench;
+    benchmark_create(&bench, argc, argv);
+
+    selected_kernel = strcmp(kernel_name, "reference") == 0 ? NULL : gemm_select(kernel_name);
+    if (strcmp(kernel_name, "reference") != 0 && selected_kernel == NULL) {
+        if (my_rank == ROOT_RANK) {
+            printf("Kernel %s is unknown or not supported by this processor\n", kernel_name);
+        }
+        PMPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+    if (selected_kernel != NULL) {
+        param_record("kernel_selected", selected_kernel->name, PARAM_STRING);
+    }
+
+    if (my_rank == ROOT_RANK) {
+        params_print_header(stdout, argv[0]);
+    }
+
+    /* This rank's matrices and the kernel's workspace all come from one arena */
+    const int rows_per_rank = partition_count(a_rows, my_rank, num_ranks);
+    const size_t workspace_bytes = selected_kernel ? gemm_workspace_size(selected_kernel) * sizeof(double) : 0;
+    size_t arena_bytes = ARENA_SIZE(workspace_bytes);
+    if (!benchmark) {
+        arena_bytes += ARENA_SIZE(b_rows * b_cols * sizeof(double)) +
+                       ARENA_SIZE(rows_per_rank * a_cols * sizeof(double)) +
+                       ARENA_SIZE(rows_per_rank * b_cols * sizeof(double));
+    }
+    struct arena buffers;
+    arena_create(&buffers, arena_bytes, alloc_mem ? ARENA_MPI_MEMORY : 0);
+    gemm_workspace = arena_alloc(&buffers, workspace_bytes);
 
-    const int a_rows = 10;
-    const int a_cols = 7;
-    const int b_rows = 7;
-    const int b_cols = 12;
+    if (benchmark) {
+        benchmark_destroy(&bench);
+        benchmark_multiply(argc, argv, min_size, max_size, reference_max, my_rank);
+        arena_destroy(&buffers);
+        return MPI_Finalize();
+    }
 
     if (a_cols != b_rows) {
         printf("Invalid dimensions for matrix a and b\n");
         PMPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
     }
 
-    matrix_b = malloc(b_rows * b_cols * sizeof(double));
+    matrix_b = arena_alloc(&buffers, b_rows * b_cols * sizeof(double));
 
     if (my_rank == ROOT_RANK) {
         matrix_a = malloc(a_rows * a_cols * sizeof(double));
@@ -59,18 +212,32 @@ int main(int argc, char **argv)
         }
     }
 
-    const int rows_per_rank = a_rows / num_ranks;
-    double *local_a = malloc(rows_per_rank * a_cols * sizeof(double));
-    double *local_result = malloc(rows_per_rank * b_cols * sizeof(double));
+    /* Divide the rows of A, and so of the result, as evenly as possible, so
+     * any number of ranks works even when a_rows isn't a multiple of it */
+    struct partition a_parts, result_parts;
+    partition_create(&a_parts, a_rows, num_ranks, a_cols);
+    partition_create(&result_parts, a_rows, num_ranks, b_cols);
+    double *local_a = arena_alloc(&buffers, rows_per_rank * a_cols * sizeof(double));
+    double *local_result = arena_alloc(&buffers, rows_per_rank * b_cols * sizeof(double));
 
+    /* Every rank gets a copy of all of B, see matrix-multiply-summa.c for a
+     * version which divides all three matrices between the ranks */
     MPI_Bcast(matrix_b, b_rows * b_cols, MPI_DOUBLE, ROOT_RANK, MPI_COMM_WORLD);
-    MPI_Scatter(matrix_a, rows_per_rank * a_cols, MPI_DOUBLE, local_a, rows_per_rank * a_cols, MPI_DOUBLE, ROOT_RANK,
-                MPI_COMM_WORLD);
+    MPI_Scatterv(matrix_a, a_parts.counts, a_parts.displs, MPI_DOUBLE, local_a, rows_per_rank * a_cols, MPI_DOUBLE,
+                 ROOT_RANK, MPI_COMM_WORLD);
 
-    multiply_matrix(local_a, matrix_b, local_result, a_rows, a_cols, b_cols, rows_per_rank, my_rank);
+    /* multiply_matrix() adds to the result, so it starts from zero every run */
+    while (benchmark_next(&bench)) {
+        memset(local_result, 0, rows_per_rank * b_cols * sizeof(double));
+        benchmark_start(&bench, "multiply");
+        multiply_matrix(local_a, matrix_b, local_result, a_rows, a_cols, b_cols, rows_per_rank, my_rank);
+        benchmark_stop(&bench, "multiply");
+    }
 
-    MPI_Gather(local_result, rows_per_rank * b_cols, MPI_DOUBLE, matrix_result, rows_per_rank * b_cols, MPI_DOUBLE,
-               ROOT_RANK, MPI_COMM_WORLD);
+    MPI_Gatherv(local_result, rows_per_rank * b_cols, MPI_DOUBLE, matrix_result, result_parts.counts,
+                result_parts.displs, MPI_DOUBLE, ROOT_RANK, MPI_COMM_WORLD);
+    partition_free(&a_parts);
+    partition_free(&result_parts);
 
     if (my_rank == ROOT_RANK) {
         for (int i = 0; i < a_rows; ++i) {
@@ -79,7 +246,13 @@ int main(int argc, char **argv)
             }
             printf("\n");
         }
+        free(matrix_a);
+        free(matrix_result);
     }
 
+    benchmark_report(&bench);
+    benchmark_destroy(&bench);
+    arena_destroy(&buffers);
+
     return MPI_Finalize();
 }
\ No newline at end of file
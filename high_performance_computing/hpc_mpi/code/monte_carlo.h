@@ -0,0 +1,262 @@
+/*
+ * monte_carlo.h - Monte Carlo integration over MPI ranks and OpenMP threads
+ *
+ * mc_integrate() estimates the integral of a function over [0, 1)^dims as
+ * the mean of its values at num_samples random points, shared between the
+ * ranks and their threads. Point k always uses the same numbers from
+ * philox.h, so the same points are sampled in any layout. The integrand is
+ * given a batch of points, dims coordinates each, and stores its value at
+ * each, e.g. a quarter of a circle:
+ *
+ *   static void quarter_circle(long n, int dims, const double *x, double *f, void *context)
+ *   {
+ *       for (long i = 0; i < n; ++i) {
+ *           f[i] = x[2 * i] * x[2 * i] + x[2 * i + 1] * x[2 * i + 1] <= 1.0;
+ *       }
+ *   }
+ *
+ *   struct mc_result result;
+ *   mc_integrate(quarter_circle, 2, NULL, 1000000000000, seed, MPI_COMM_WORLD, &result);
+ *
+ * Every rank gets the mean, its standard error and the slowest rank's
+ * time. The sums are doubles, added up in a fixed order so the result
+ * doesn't change from run to run.
+ *
+ * For the volume of a region, mc_count() counts the points inside it
+ * instead, exactly, with 64-bit integers reduced to the root rank. Its
+ * indicator returns how many of a batch of points are inside, e.g.
+ *
+ *   static long in_circle(long n, int dims, const double *x, void *context)
+ *   {
+ *       long hits = 0;
+ *       for (long i = 0; i < n; ++i) {
+ *           hits += x[2 * i] * x[2 * i] + x[2 * i + 1] * x[2 * i + 1] <= 1.0;
+ *       }
+ *       return hits;
+ *   }
+ *
+ *   struct mc_count_result count;
+ *   mc_count(in_circle, 2, NULL, 1000000000000, seed, 0, MPI_COMM_WORLD, &count);
+ *
+ * Compile with -fopenmp to use threads.
+ */
+
+#ifndef MONTE_CARLO_H
+#define MONTE_CARLO_H
+
+#include <math.h>
+#include <mpi.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "partition.h"
+#include "philox.h"
+
+/* The number of points the integrand is called on at once */
+#define MC_BATCH 1024
+
+typedef void (*mc_integrand)(long n, int dims, const double *x, double *f, void *context);
+
+/* Returns the number of the n points which are inside the region */
+typedef long (*mc_indicator)(long n, int dims, const double *x, void *context);
+
+struct mc_result {
+    uint64_t samples;
+    double sum;          /* of the values at each point */
+    double sum_squares;  /* of the squares of the values */
+    double mean;         /* the estimate of the integral */
+    double standard_error;
+    double seconds;      /* on the slowest rank */
+};
+
+struct mc_count_result {
+    uint64_t samples;
+    uint64_t hits;       /* the points inside the region */
+    double fraction;     /* hits / samples, the estimate of its volume */
+    double standard_error;
+    double seconds;      /* on the slowest rank */
+};
+
+/* The number of threads each rank uses */
+static inline int mc_num_threads(void)
+{
+#ifdef _OPENMP
+    return omp_get_max_threads();
+#else
+    return 1;
+#endif
+}
+
+/* Sample the points in [first, first + count) of the run on one thread */
+static inline void mc_sample(mc_integrand integrand, int dims, void *context, uint64_t first, uint64_t count,
+                             uint64_t seed, double *sum, double *sum_squares)
+{
+    double *x = malloc(MC_BATCH * dims * sizeof(double));
+    double *f = malloc(MC_BATCH * sizeof(double));
+    if (x == NULL || f == NULL) {
+        fprintf(stderr, "Could not allocate a batch of %d points\n", MC_BATCH);
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+
+    struct philox_stream rng;
+    philox_init(&rng, seed, 0);
+    philox_seek(&rng, first * dims);
+
+    double s = 0.0, s2 = 0.0;
+    for (uint64_t done = 0; done < count; done += MC_BATCH) {
+        long batch = count - done < MC_BATCH ? (long)(count - done) : MC_BATCH;
+        philox_generate(&rng, (size_t)batch * dims, x);
+        integrand(batch, dims, x, f, context);
+        for (long i = 0; i < batch; ++i) {
+            s += f[i];
+            s2 += f[i] * f[i];
+        }
+    }
+
+    *sum = s;
+    *sum_squares = s2;
+    free(x);
+    free(f);
+}
+
+/* Count the points in [first, first + count) of the run which are inside
+ * the region, on one thread */
+static inline uint64_t mc_sample_hits(mc_indicator indicator, int dims, void *context, uint64_t first,
+                                      uint64_t count, uint64_t seed)
+{
+    double *x = malloc(MC_BATCH * dims * sizeof(double));
+    if (x == NULL) {
+        fprintf(stderr, "Could not allocate a batch of %d points\n", MC_BATCH);
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+
+    struct philox_stream rng;
+    philox_init(&rng, seed, 0);
+    philox_seek(&rng, first * dims);
+
+    uint64_t hits = 0;
+    for (uint64_t done = 0; done < count; done += MC_BATCH) {
+        long batch = count - done < MC_BATCH ? (long)(count - done) : MC_BATCH;
+        philox_generate(&rng, (size_t)batch * dims, x);
+        hits += indicator(batch, dims, x, context);
+    }
+
+    free(x);
+    return hits;
+}
+
+/* Integrate over [0, 1)^dims with num_samples points in total, across all of
+ * the ranks in comm, which must all call this with the same arguments */
+static inline void mc_integrate(mc_integrand integrand, int dims, void *context, uint64_t num_samples, uint64_t seed,
+                                MPI_Comm comm, struct mc_result *result)
+{
+    int rank, num_ranks;
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_size(comm, &num_ranks);
+
+    /* Share out the points between the ranks, then between the threads of each */
+    uint64_t rank_first = partition_start(num_samples, rank, num_ranks);
+    uint64_t rank_count = partition_count(num_samples, rank, num_ranks);
+
+    /* Each thread's sums are kept apart and added up in order afterwards, so
+       the total doesn't depend on which thread finishes first */
+    double *thread_sums = calloc(2 * (size_t)mc_num_threads(), sizeof(double));
+    if (thread_sums == NULL) {
+        fprintf(stderr, "Could not allocate the sums of %d threads\n", mc_num_threads());
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+    uint64_t samples = 0;
+    double start = MPI_Wtime();
+
+#ifdef _OPENMP
+#pragma omp parallel reduction(+ : samples)
+#endif
+    {
+        int thread = 0, num_threads = 1;
+#ifdef _OPENMP
+        thread = omp_get_thread_num();
+        num_threads = omp_get_num_threads();
+#endif
+        uint64_t first = rank_first + partition_start(rank_count, thread, num_threads);
+        uint64_t count = partition_count(rank_count, thread, num_threads);
+        mc_sample(integrand, dims, context, first, count, seed, &thread_sums[2 * thread],
+                  &thread_sums[2 * thread + 1]);
+        samples += count;
+    }
+    double elapsed = MPI_Wtime() - start;
+
+    double sums[2] = {0.0, 0.0};
+    for (int t = 0; t < mc_num_threads(); ++t) {
+        sums[0] += thread_sums[2 * t];
+        sums[1] += thread_sums[2 * t + 1];
+    }
+    free(thread_sums);
+
+    double total_sums[2];
+    MPI_Allreduce(sums, total_sums, 2, MPI_DOUBLE, MPI_SUM, comm);
+    MPI_Allreduce(&samples, &result->samples, 1, MPI_UINT64_T, MPI_SUM, comm);
+    MPI_Allreduce(&elapsed, &result->seconds, 1, MPI_DOUBLE, MPI_MAX, comm);
+
+    double n = (double)result->samples;
+    result->sum = total_sums[0];
+    result->sum_squares = total_sums[1];
+    result->mean = result->sum / n;
+    double variance = n > 1 ? (result->sum_squares / n - result->mean * result->mean) * n / (n - 1) : 0.0;
+    result->standard_error = variance > 0.0 ? sqrt(variance / n) : 0.0;
+}
+
+/* Estimate the volume of a region of [0, 1)^dims from the fraction of
+ * num_samples points inside it, across all of the ranks in comm, which must
+ * all call this with the same arguments. Only root gets the result. */
+static inline void mc_count(mc_indicator indicator, int dims, void *context, uint64_t num_samples, uint64_t seed,
+                            int root, MPI_Comm comm, struct mc_count_result *result)
+{
+    int rank, num_ranks;
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_size(comm, &num_ranks);
+
+    uint64_t rank_first = partition_start(num_samples, rank, num_ranks);
+    uint64_t rank_count = partition_count(num_samples, rank, num_ranks);
+
+    /* Integer sums are exact in any order, so the threads can use a reduction clause */
+    uint64_t counts[2] = {0, 0};
+    uint64_t samples = 0, hits = 0;
+    double start = MPI_Wtime();
+
+#ifdef _OPENMP
+#pragma omp parallel reduction(+ : samples, hits)
+#endif
+    {
+        int thread = 0, num_threads = 1;
+#ifdef _OPENMP
+        thread = omp_get_thread_num();
+        num_threads = omp_get_num_threads();
+#endif
+        uint64_t first = rank_first + partition_start(rank_count, thread, num_threads);
+        uint64_t count = partition_count(rank_count, thread, num_threads);
+        hits += mc_sample_hits(indicator, dims, context, first, count, seed);
+        samples += count;
+    }
+    double elapsed = MPI_Wtime() - start;
+
+    uint64_t local_counts[2] = {samples, hits};
+    MPI_Reduce(local_counts, counts, 2, MPI_UINT64_T, MPI_SUM, root, comm);
+    MPI_Reduce(&elapsed, &result->seconds, 1, MPI_DOUBLE, MPI_MAX, root, comm);
+    if (rank != root) {
+        return;
+    }
+
+    double n = (double)counts[0];
+    result->samples = counts[0];
+    result->hits = counts[1];
+    result->fraction = counts[1] / n;
+    double variance = n > 1 ? result->fraction * (1.0 - result->fraction) * n / (n - 1) : 0.0;
+    result->standard_error = sqrt(variance / n);
+}
+
+#endif
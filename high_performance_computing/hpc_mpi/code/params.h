@@ -0,0 +1,306 @@
+/*
+ * params.h - run time parameters for the example programs
+ *
+ * Each parameter is looked up by name, in order of precedence, from:
+ *
+ *   1. the command line, as --name value, --name=value, or just --name for 1
+ *   2. an environment variable with the upper case name after HPC_, e.g.
+ *      HPC_GRIDSIZE=512
+ *   3. a configuration file given with --config <file>, or the PARAMS_FILE
+ *      environment variable, holding lines of "name = value" (# starts a
+ *      comment)
+ *   4. the default given by the program
+ *
+ * Dashes and underscores in names are interchangeable, so --max-iterations
+ * sets max_iterations. A program reads its parameters, then prints them, e.g.
+ *
+ *   long gridsize = param_long(argc, argv, "gridsize", 12);
+ *   params_print_header(stdout, argv[0]);
+ *
+ * params_print_header() prints every value looked up as a line of JSON
+ * starting with "# run", and warns about any --name the program never
+ * looked up.
+ */
+
+#ifndef PARAMS_H
+#define PARAMS_H
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PARAMS_MAX 64
+#define PARAMS_NAME_LENGTH 64
+#define PARAMS_VALUE_LENGTH 256
+#define PARAMS_ENV_PREFIX "HPC_"
+
+enum param_type { PARAM_LONG, PARAM_DOUBLE, PARAM_STRING };
+
+struct param {
+    char name[PARAMS_NAME_LENGTH];
+    char value[PARAMS_VALUE_LENGTH];
+    enum param_type type;
+};
+
+static struct param params_used[PARAMS_MAX];
+static int params_num_used = 0;
+
+/* The command line, kept to check for unknown options */
+static int params_argc = 0;
+static char **params_argv = NULL;
+
+/* Compare a parameter name, treating dashes and underscores as the same */
+static inline int params_name_equal(const char *a, const char *b, size_t length)
+{
+    for (size_t i = 0; i < length; ++i) {
+        char ca = a[i] == '-' ? '_' : a[i];
+        char cb = b[i] == '-' ? '_' : b[i];
+        if (ca != cb || ca == '\0') {
+            return 0;
+        }
+    }
+    return b[length] == '\0';
+}
+
+/* Look for --name value, --name=value or a bare --name on the command line */
+static inline const char *params_from_args(int argc, char **argv, const char *name)
+{
+    for (int i = 1; i < argc; ++i) {
+        const char *arg = argv[i];
+        if (strncmp(arg, "--", 2) != 0) {
+            continue;
+        }
+        arg += 2;
+        const char *equals = strchr(arg, '=');
+        size_t length = equals ? (size_t)(equals - arg) : strlen(arg);
+        if (!params_name_equal(arg, name, length)) {
+            continue;
+        }
+        if (equals) {
+            return equals + 1;
+        }
+        if (i + 1 < argc && strncmp(argv[i + 1], "--", 2) != 0) {
+            return argv[i + 1];
+        }
+        return "1";
+    }
+    return NULL;
+}
+
+/* Look for an environment variable with the upper case name after the
+ * prefix, e.g. HPC_MAX_ITERATIONS */
+static inline const char *params_from_env(const char *name)
+{
+    char env_name[sizeof(PARAMS_ENV_PREFIX) + PARAMS_NAME_LENGTH];
+    size_t length = strlen(PARAMS_ENV_PREFIX);
+    memcpy(env_name, PARAMS_ENV_PREFIX, length);
+    for (size_t i = 0; name[i] != '\0' && i < PARAMS_NAME_LENGTH - 1; ++i) {
+        env_name[length++] = name[i] == '-' ? '_' : toupper((unsigned char)name[i]);
+    }
+    env_name[length] = '\0';
+    return getenv(env_name);
+}
+
+/* Look for a "name = value" line in the configuration file */
+static inline const char *params_from_file(int argc, char **argv, const char *name, char *value)
+{
+    const char *path = params_from_args(argc, argv, "config");
+    if (path == NULL) {
+        path = getenv("PARAMS_FILE");
+    }
+    if (path == NULL) {
+        return NULL;
+    }
+
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        fprintf(stderr, "Could not open parameter file %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+
+    const char *found = NULL;
+    char line[PARAMS_NAME_LENGTH + PARAMS_VALUE_LENGTH];
+    while (found == NULL && fgets(line, sizeof(line), file)) {
+        char key[PARAMS_NAME_LENGTH];
+        line[strcspn(line, "#\r\n")] = '\0';
+        if (sscanf(line, " %63[^= \t] = %255s", key, value) == 2 && params_name_equal(key, name, strlen(key))) {
+            found = value;
+        }
+    }
+
+    fclose(file);
+    return found;
+}
+
+/* Remember a value so it appears in the run header. Looking up the same
+ * name again replaces the earlier value. */
+static inline void param_record(const char *name, const char *value, enum param_type type)
+{
+    int i;
+    for (i = 0; i < params_num_used; ++i) {
+        if (strcmp(params_used[i].name, name) == 0) {
+            break;
+        }
+    }
+    if (i == PARAMS_MAX) {
+        return;
+    }
+    if (i == params_num_used) {
+        params_num_used++;
+    }
+    snprintf(params_used[i].name, PARAMS_NAME_LENGTH, "%s", name);
+    snprintf(params_used[i].value, PARAMS_VALUE_LENGTH, "%s", value);
+    params_used[i].type = type;
+}
+
+/* Find the value of a parameter, or NULL if it has not been given */
+static inline const char *param_lookup(int argc, char **argv, const char *name, char *buffer)
+{
+    params_argc = argc;
+    params_argv = argv;
+    const char *value = params_from_args(argc, argv, name);
+    if (value == NULL) {
+        value = params_from_env(name);
+    }
+    if (value == NULL) {
+        value = params_from_file(argc, argv, name, buffer);
+    }
+    return value;
+}
+
+static inline long param_long(int argc, char **argv, const char *name, long default_value)
+{
+    char buffer[PARAMS_VALUE_LENGTH];
+    const char *text = param_lookup(argc, argv, name, buffer);
+    long value = default_value;
+
+    if (text != NULL) {
+        char *end;
+        /* Accept values such as 1e8 as well as plain integers */
+        value = strtol(text, &end, 10);
+        if (*end != '\0') {
+            double real = strtod(text, &end);
+            if (*end != '\0') {
+                fprintf(stderr, "Parameter %s should be an integer, not '%s'\n", name, text);
+                exit(EXIT_FAILURE);
+            }
+            value = (long)real;
+        }
+    }
+
+    snprintf(buffer, sizeof(buffer), "%ld", value);
+    param_record(name, buffer, PARAM_LONG);
+    return value;
+}
+
+static inline double param_double(int argc, char **argv, const char *name, double default_value)
+{
+    char buffer[PARAMS_VALUE_LENGTH];
+    const char *text = param_lookup(argc, argv, name, buffer);
+    double value = default_value;
+
+    if (text != NULL) {
+        char *end;
+        value = strtod(text, &end);
+        if (*end != '\0') {
+            fprintf(stderr, "Parameter %s should be a number, not '%s'\n", name, text);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    snprintf(buffer, sizeof(buffer), "%.17g", value);
+    param_record(name, buffer, PARAM_DOUBLE);
+    return value;
+}
+
+/* The returned string stays valid until the program ends */
+static inline const char *param_string(int argc, char **argv, const char *name, const char *default_value)
+{
+    char buffer[PARAMS_VALUE_LENGTH];
+    const char *text = param_lookup(argc, argv, name, buffer);
+
+    param_record(name, text != NULL ? text : default_value, PARAM_STRING);
+    for (int i = 0; i < params_num_used; ++i) {
+        if (strcmp(params_used[i].name, name) == 0) {
+            return params_used[i].value;
+        }
+    }
+    return default_value;
+}
+
+/* Record a value that isn't read from the user, such as the number of
+ * ranks or threads, so it still appears in the run header */
+static inline void param_record_long(const char *name, long value)
+{
+    char buffer[PARAMS_VALUE_LENGTH];
+    snprintf(buffer, sizeof(buffer), "%ld", value);
+    param_record(name, buffer, PARAM_LONG);
+}
+
+/* The name of the program, without the directory it was run from */
+static inline const char *params_program_name(const char *program)
+{
+    const char *base = strrchr(program, '/');
+    return base ? base + 1 : program;
+}
+
+/* Print a string as a quoted JSON string */
+static inline void params_print_string(FILE *out, const char *value)
+{
+    fputc('"', out);
+    for (const char *c = value; *c != '\0'; ++c) {
+        if (*c == '"' || *c == '\\') {
+            fputc('\\', out);
+        }
+        fputc(*c, out);
+    }
+    fputc('"', out);
+}
+
+/* Print every parameter used so far as JSON members, each starting with a
+ * comma, ready to go inside an object */
+static inline void params_print_members(FILE *out)
+{
+    for (int i = 0; i < params_num_used; ++i) {
+        fprintf(out, ", \"%s\": ", params_used[i].name);
+        if (params_used[i].type == PARAM_STRING) {
+            params_print_string(out, params_used[i].value);
+        } else {
+            fputs(params_used[i].value, out);
+        }
+    }
+}
+
+/* Warn about every --name on the command line that hasn't been looked up */
+static inline void params_check_args(const char *program)
+{
+    for (int i = 1; i < params_argc; ++i) {
+        const char *arg = params_argv[i];
+        if (strncmp(arg, "--", 2) != 0) {
+            continue;
+        }
+        arg += 2;
+        size_t length = strcspn(arg, "=");
+        int known = params_name_equal(arg, "config", length);
+        for (int p = 0; !known && p < params_num_used; ++p) {
+            known = params_name_equal(arg, params_used[p].name, length);
+        }
+        if (!known) {
+            fprintf(stderr, "Warning: %s doesn't have a parameter called --%.*s, so it was ignored\n",
+                    params_program_name(program), (int)length, arg);
+        }
+    }
+}
+
+/* Print every parameter used so far as one line of JSON, after warning
+ * about any on the command line that weren't used */
+static inline void params_print_header(FILE *out, const char *program)
+{
+    params_check_args(program);
+    fprintf(out, "# run {\"program\": \"%s\"", params_program_name(program));
+    params_print_members(out);
+    fprintf(out, "}\n");
+}
+
+#endif
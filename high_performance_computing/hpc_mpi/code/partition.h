@@ -0,0 +1,143 @@
+/*
+ * partition.h - dividing work evenly between ranks
+ *
+ * The first n % num_ranks ranks get one extra item each.
+ * partition_count() and partition_start() give the share of a single rank,
+ * and partition_create() the counts and displacements of every rank, ready
+ * for MPI_Scatterv() and MPI_Gatherv(), e.g. to divide a matrix by rows
+ *
+ *   struct partition rows;
+ *   partition_create(&rows, num_rows, num_ranks, row_length);
+ *   MPI_Scatterv(matrix, rows.counts, rows.displs, MPI_DOUBLE,
+ *                local_rows, rows.counts[my_rank], MPI_DOUBLE, ROOT_RANK, MPI_COMM_WORLD);
+ *   partition_free(&rows);
+ *
+ * When items have different, known costs, partition_weighted() gives each
+ * part a contiguous range of about the same total cost, and
+ * partition_linear_start() does the same for costs a + b i without a
+ * table, e.g. for the rows of an upper triangle
+ *
+ *   long first = partition_linear_start(n, thread, num_threads, n - 1, -1);
+ *   long last = partition_linear_start(n, thread + 1, num_threads, n - 1, -1);
+ */
+
+#ifndef PARTITION_H
+#define PARTITION_H
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+struct partition {
+    int num_ranks;
+    int *counts;
+    int *displs;
+};
+
+/* The number of the n items given to rank */
+static inline long partition_count(long n, int rank, int num_ranks)
+{
+    return n / num_ranks + (rank < n % num_ranks ? 1 : 0);
+}
+
+/* The index of the first of the n items given to rank */
+static inline long partition_start(long n, int rank, int num_ranks)
+{
+    long remainder = n % num_ranks;
+    return rank * (n / num_ranks) + (rank < remainder ? rank : remainder);
+}
+
+/* Find the count and displacement of every rank's share of n items, in
+ * units of unit elements, e.g. the length of a row when dividing a matrix
+ * by rows */
+static inline void partition_create(struct partition *partition, long n, int num_ranks, int unit)
+{
+    partition->num_ranks = num_ranks;
+    partition->counts = malloc(num_ranks * sizeof(*partition->counts));
+    partition->displs = malloc(num_ranks * sizeof(*partition->displs));
+    if (partition->counts == NULL || partition->displs == NULL) {
+        fprintf(stderr, "Could not allocate a partition for %d ranks\n", num_ranks);
+        exit(EXIT_FAILURE);
+    }
+
+    for (int rank = 0; rank < num_ranks; ++rank) {
+        partition->counts[rank] = (int)(partition_count(n, rank, num_ranks) * unit);
+        partition->displs[rank] = (int)(partition_start(n, rank, num_ranks) * unit);
+    }
+}
+
+/* The cost of item i, for partition_weighted() */
+typedef double (*partition_cost)(long i, void *context);
+
+/* Split the n items into num_parts contiguous ranges of about equal total
+ * cost, part p having the items starts[p] to starts[p + 1] - 1. starts must
+ * have room for num_parts + 1 entries. Each boundary is put at whichever
+ * item brings the cost before it closest to its share. */
+static inline void partition_weighted(long n, int num_parts, partition_cost cost, void *context, long *starts)
+{
+    double total = 0.0;
+    for (long i = 0; i < n; ++i) {
+        total += cost(i, context);
+    }
+
+    double before = 0.0;
+    long i = 0;
+    starts[0] = 0;
+    for (int part = 1; part < num_parts; ++part) {
+        double target = total * part / num_parts;
+        while (i < n) {
+            double item = cost(i, context);
+            if (before + item > target) {
+                /* Include the item if that comes closer to the target */
+                if (before + item - target < target - before) {
+                    before += item;
+                    i++;
+                }
+                break;
+            }
+            before += item;
+            i++;
+        }
+        starts[part] = i;
+    }
+    starts[num_parts] = n;
+}
+
+/* The first of the n items given to part, when item i costs a + b i and
+ * each part gets a contiguous range of about equal total cost. The costs
+ * must not be negative. */
+static inline long partition_linear_start(long n, int part, int num_parts, double a, double b)
+{
+    if (part <= 0) {
+        return 0;
+    }
+    if (part >= num_parts) {
+        return n;
+    }
+
+    /* The items before k cost a k + b k (k - 1) / 2, so solve
+       (b / 2) k^2 + (a - b / 2) k = target, in whichever form avoids
+       cancellation, and round to the nearest item */
+    double total = a * n + b * ((double)n * (n - 1) / 2);
+    if (total <= 0) {
+        /* Every item is free, so share them out by number instead */
+        return partition_start(n, part, num_parts);
+    }
+    double target = total * part / num_parts;
+    double linear = a - b / 2;
+    double root = sqrt(fmax(linear * linear + 2 * b * target, 0.0));
+    double k = linear >= 0 ? 2 * target / (linear + root) : (root - linear) / b;
+
+    long start = (long)(k + 0.5);
+    return start < 0 ? 0 : start > n ? n : start;
+}
+
+static inline void partition_free(struct partition *partition)
+{
+    free(partition->counts);
+    free(partition->displs);
+    partition->counts = NULL;
+    partition->displs = NULL;
+}
+
+#endif
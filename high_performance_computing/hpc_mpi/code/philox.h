@@ -0,0 +1,148 @@
+/*
+ * philox.h - a counter-based random number generator
+ *
+ * Philox4x32-10 (Salmon et al., "Parallel Random Numbers: As Easy as 1, 2,
+ * 3", SC11) turns a 128-bit counter and a 64-bit key, the seed, into four
+ * 32-bit random numbers, with no other state. Any number of a sequence can
+ * be computed directly, so each rank or thread can philox_seek() to its own
+ * part of one sequence and together they draw the same numbers in any
+ * layout. The stream number gives independent sequences, e.g.
+ *
+ *   struct philox_stream rng;
+ *   philox_init(&rng, seed, 0);
+ *   philox_seek(&rng, first);          // skip to number first of the sequence
+ *   philox_generate(&rng, n, numbers); // n doubles in (0, 1)
+ *
+ * philox_generate() works on a batch of counters at once so it vectorises;
+ * compile with -O3 -march=native for the best speed.
+ */
+
+#ifndef PHILOX_H
+#define PHILOX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define PHILOX_M0 0xD2511F53u
+#define PHILOX_M1 0xCD9E8D57u
+#define PHILOX_W0 0x9E3779B9u
+#define PHILOX_W1 0xBB67AE85u
+#define PHILOX_ROUNDS 10
+
+/* The number of counters scrambled together by philox_generate() */
+#define PHILOX_BATCH 128
+
+struct philox_stream {
+    uint32_t key[2];
+    uint64_t stream;
+    uint64_t position; /* the next 32-bit number to return */
+};
+
+/* Scramble one counter into four random numbers */
+static inline void philox4x32(const uint32_t counter[4], const uint32_t key[2], uint32_t out[4])
+{
+    uint32_t c0 = counter[0], c1 = counter[1], c2 = counter[2], c3 = counter[3];
+    uint32_t k0 = key[0], k1 = key[1];
+
+    for (int round = 0; round < PHILOX_ROUNDS; ++round) {
+        uint64_t p0 = (uint64_t)PHILOX_M0 * c0;
+        uint64_t p1 = (uint64_t)PHILOX_M1 * c2;
+        c0 = (uint32_t)(p1 >> 32) ^ c1 ^ k0;
+        c1 = (uint32_t)p1;
+        c2 = (uint32_t)(p0 >> 32) ^ c3 ^ k1;
+        c3 = (uint32_t)p0;
+        k0 += PHILOX_W0;
+        k1 += PHILOX_W1;
+    }
+
+    out[0] = c0;
+    out[1] = c1;
+    out[2] = c2;
+    out[3] = c3;
+}
+
+/* Scramble n <= PHILOX_BATCH consecutive counters, starting at block first
+ * of a stream, storing the four numbers of each counter in turn */
+static inline void philox4x32_blocks(const uint32_t key[2], uint64_t stream, uint64_t first, int n, uint32_t *out)
+{
+    uint32_t c0[PHILOX_BATCH], c1[PHILOX_BATCH], c2[PHILOX_BATCH], c3[PHILOX_BATCH];
+    uint32_t k0 = key[0], k1 = key[1];
+
+    for (int b = 0; b < n; ++b) {
+        c0[b] = (uint32_t)(first + b);
+        c1[b] = (uint32_t)((first + b) >> 32);
+        c2[b] = (uint32_t)stream;
+        c3[b] = (uint32_t)(stream >> 32);
+    }
+
+    /* Apply each round to the whole batch, so the loop over b vectorises */
+    for (int round = 0; round < PHILOX_ROUNDS; ++round) {
+        for (int b = 0; b < n; ++b) {
+            uint64_t p0 = (uint64_t)PHILOX_M0 * c0[b];
+            uint64_t p1 = (uint64_t)PHILOX_M1 * c2[b];
+            c0[b] = (uint32_t)(p1 >> 32) ^ c1[b] ^ k0;
+            c1[b] = (uint32_t)p1;
+            c2[b] = (uint32_t)(p0 >> 32) ^ c3[b] ^ k1;
+            c3[b] = (uint32_t)p0;
+        }
+        k0 += PHILOX_W0;
+        k1 += PHILOX_W1;
+    }
+
+    for (int b = 0; b < n; ++b) {
+        out[4 * b] = c0[b];
+        out[4 * b + 1] = c1[b];
+        out[4 * b + 2] = c2[b];
+        out[4 * b + 3] = c3[b];
+    }
+}
+
+/* Start at the beginning of one stream of the sequence for a seed */
+static inline void philox_init(struct philox_stream *rng, uint64_t seed, uint64_t stream)
+{
+    rng->key[0] = (uint32_t)seed;
+    rng->key[1] = (uint32_t)(seed >> 32);
+    rng->stream = stream;
+    rng->position = 0;
+}
+
+/* Move to the given position in the stream, counted in numbers returned */
+static inline void philox_seek(struct philox_stream *rng, uint64_t position)
+{
+    rng->position = position;
+}
+
+/* A 32-bit random number as a double in (0, 1), which is never exactly 0
+ * or 1 */
+static inline double philox_to_double(uint32_t x)
+{
+    return (x + 0.5) * 0x1.0p-32;
+}
+
+/* Fill numbers with the next n random doubles of the stream */
+static inline void philox_generate(struct philox_stream *rng, size_t n, double *numbers)
+{
+    uint32_t words[4 * PHILOX_BATCH];
+
+    while (n > 0) {
+        uint64_t first_block = rng->position / 4;
+        int skip = (int)(rng->position % 4);
+        size_t wanted = skip + n;
+        int blocks = wanted >= 4 * PHILOX_BATCH ? PHILOX_BATCH : (int)((wanted + 3) / 4);
+        size_t count = (size_t)4 * blocks - skip;
+        if (count > n) {
+            count = n;
+        }
+
+        philox4x32_blocks(rng->key, rng->stream, first_block, blocks, words);
+        for (size_t i = 0; i < count; ++i) {
+            numbers[i] = philox_to_double(words[skip + i]);
+        }
+
+        numbers += count;
+        n -= count;
+        rng->position += count;
+    }
+}
+
+#endif
@@ -0,0 +1,329 @@
+/*
+ * prime_sieve.h - counting primes with a segmented Sieve of Eratosthenes
+ *
+ * prime_sieve_count() sieves with a mod 30 wheel, one bit per candidate,
+ * copies in the multiples of 7, 11, 13 and 17 from a pre-sieved pattern,
+ * and works through cache sized segments of segment_bytes. Ranks take
+ * chunks of segments from a task farm, see task_farm.h, and split each
+ * between their OpenMP threads. Each rank gets back the primes up to and
+ * including limit in the chunks it took, to be added up, e.g.
+ *
+ *   struct task_farm_stats stats;
+ *   long count = prime_sieve_count(limit, 256 * 1024, 8, TASK_FARM_GUIDED, MPI_COMM_WORLD, &stats);
+ *   MPI_Reduce(&count, &total, 1, MPI_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
+ *
+ * Compile with -fopenmp to use threads.
+ */
+
+#ifndef PRIME_SIEVE_H
+#define PRIME_SIEVE_H
+
+#include <mpi.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "partition.h"
+#include "task_farm.h"
+
+/* The numbers in every 30 which can be prime, one for each bit of a byte */
+static const int PRIME_SIEVE_RESIDUES[8] = {1, 7, 11, 13, 17, 19, 23, 29};
+
+/* The bit for each number mod 30, or -1 for those divisible by 2, 3 or 5 */
+static const int PRIME_SIEVE_BIT[30] = {-1, 0,  -1, -1, -1, -1, -1, 1,  -1, -1, -1, 2,  -1, 3,  -1,
+                                        -1, -1, 4,  -1, 5,  -1, -1, -1, 6,  -1, -1, -1, -1, -1, 7};
+
+/* The primes crossed off by copying a pattern into each segment */
+static const int PRIME_SIEVE_PRESIEVED[4] = {7, 11, 13, 17};
+#define PRIME_SIEVE_PATTERN_BYTES (7 * 11 * 13 * 17)
+
+/* A sieving prime, with the offset of the next multiple to cross off in
+ * each of the 8 classes, from the start of the current segment */
+struct prime_sieve_prime {
+    uint32_t prime;
+    uint32_t next[8];
+    uint8_t mask[8];
+};
+
+/* The primes from 19 up to sqrt(limit), from a simple sieve */
+static inline long prime_sieve_small_primes(long limit, struct prime_sieve_prime **primes)
+{
+    long root = 1;
+    while ((root + 1) * (root + 1) <= limit) {
+        root++;
+    }
+
+    char *composite = calloc(root + 1, 1);
+    *primes = malloc((root / 2 + 1) * sizeof(struct prime_sieve_prime));
+    if (composite == NULL || *primes == NULL) {
+        fprintf(stderr, "Could not allocate the sieving primes up to %ld\n", root);
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+
+    long count = 0;
+    for (long n = 2; n <= root; ++n) {
+        if (composite[n]) {
+            continue;
+        }
+        for (long multiple = n * n; multiple <= root; multiple += n) {
+            composite[multiple] = 1;
+        }
+        if (n > 17) {
+            (*primes)[count++].prime = (uint32_t)n;
+        }
+    }
+
+    free(composite);
+    return count;
+}
+
+/* Cross off the multiples of the pre-sieved primes, and the primes
+ * themselves, from one period of the sieve */
+static inline uint8_t *prime_sieve_pattern(void)
+{
+    uint8_t *pattern = malloc(PRIME_SIEVE_PATTERN_BYTES);
+    if (pattern == NULL) {
+        fprintf(stderr, "Could not allocate the pre-sieving pattern\n");
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+    memset(pattern, 0xff, PRIME_SIEVE_PATTERN_BYTES);
+
+    for (int i = 0; i < 4; ++i) {
+        for (long n = PRIME_SIEVE_PRESIEVED[i]; n < 30L * PRIME_SIEVE_PATTERN_BYTES; n += PRIME_SIEVE_PRESIEVED[i]) {
+            if (PRIME_SIEVE_BIT[n % 30] >= 0) {
+                pattern[n / 30] &= (uint8_t)~(1u << PRIME_SIEVE_BIT[n % 30]);
+            }
+        }
+    }
+    return pattern;
+}
+
+/* Find the first multiple in each class of each prime at or after byte
+ * first, which is where the next segment starts */
+static inline void prime_sieve_start(struct prime_sieve_prime *primes, long num_primes, long first)
+{
+    uint64_t low = (uint64_t)first * 30;
+
+    for (long i = 0; i < num_primes; ++i) {
+        uint64_t p = primes[i].prime;
+        /* Smaller multiples have a smaller prime factor, so start at p * p */
+        uint64_t start = (low + p - 1) / p;
+        if (start < p) {
+            start = p;
+        }
+        int start_mod = (int)(start % 30);
+        for (int c = 0; c < 8; ++c) {
+            uint64_t multiple = p * (start + (PRIME_SIEVE_RESIDUES[c] - start_mod + 30) % 30);
+            primes[i].next[c] = (uint32_t)(multiple / 30 - first);
+            primes[i].mask[c] = (uint8_t)~(1u << PRIME_SIEVE_BIT[multiple % 30]);
+        }
+    }
+}
+
+/* Cross off the multiples in the segment of length bytes which starts at
+ * byte first, then move the offsets on to the next */
+static inline void prime_sieve_segment(uint8_t *sieve, long first, long length, const uint8_t *pattern,
+                                       struct prime_sieve_prime *primes, long num_primes)
+{
+    long offset = first % PRIME_SIEVE_PATTERN_BYTES;
+    for (long i = 0; i < length;) {
+        long copy = PRIME_SIEVE_PATTERN_BYTES - offset < length - i ? PRIME_SIEVE_PATTERN_BYTES - offset : length - i;
+        memcpy(sieve + i, pattern + offset, copy);
+        i += copy;
+        offset = 0;
+    }
+
+    for (long i = 0; i < num_primes; ++i) {
+        uint32_t p = primes[i].prime;
+
+        /* While every class still has a multiple in the segment, cross off one from each of them per step. These
+           8 stores are independent of each other, so run faster than going through the classes one by one, and
+           are written out in full so that the offsets and masks stay in registers. */
+        uint32_t *next = primes[i].next;
+        const uint8_t *mask = primes[i].mask;
+        uint32_t furthest = 0;
+        for (int c = 0; c < 8; ++c) {
+            furthest = next[c] > furthest ? next[c] : furthest;
+        }
+        if (furthest < length) {
+            uint32_t steps = ((uint32_t)length - furthest - 1) / p + 1;
+            uint32_t n0 = next[0], n1 = next[1], n2 = next[2], n3 = next[3];
+            uint32_t n4 = next[4], n5 = next[5], n6 = next[6], n7 = next[7];
+            const uint8_t m0 = mask[0], m1 = mask[1], m2 = mask[2], m3 = mask[3];
+            const uint8_t m4 = mask[4], m5 = mask[5], m6 = mask[6], m7 = mask[7];
+            for (uint32_t step = 0; step < steps; ++step) {
+                sieve[n0] &= m0;
+                sieve[n1] &= m1;
+                sieve[n2] &= m2;
+                sieve[n3] &= m3;
+                sieve[n4] &= m4;
+                sieve[n5] &= m5;
+                sieve[n6] &= m6;
+                sieve[n7] &= m7;
+                n0 += p;
+                n1 += p;
+                n2 += p;
+                n3 += p;
+                n4 += p;
+                n5 += p;
+                n6 += p;
+                n7 += p;
+            }
+            next[0] = n0, next[1] = n1, next[2] = n2, next[3] = n3;
+            next[4] = n4, next[5] = n5, next[6] = n6, next[7] = n7;
+        }
+
+        /* Then finish off each class on its own */
+        for (int c = 0; c < 8; ++c) {
+            uint32_t j = next[c];
+            for (; j < length; j += p) {
+                sieve[j] &= mask[c];
+            }
+            next[c] = j - (uint32_t)length;
+        }
+    }
+}
+
+/* The number of set bits in a segment */
+static inline long prime_sieve_popcount(const uint8_t *sieve, long length)
+{
+    long count = 0;
+    long i = 0;
+    for (; i + 8 <= length; i += 8) {
+        uint64_t word;
+        memcpy(&word, sieve + i, sizeof(word));
+        count += __builtin_popcountll(word);
+    }
+    for (; i < length; ++i) {
+        count += __builtin_popcount(sieve[i]);
+    }
+    return count;
+}
+
+/* Count the primes in one chunk of the sieve, the bytes [first, last) */
+static inline long prime_sieve_chunk(long limit, long first, long last, long segment_bytes, uint8_t *sieve,
+                                     const uint8_t *pattern, struct prime_sieve_prime *primes, long num_primes)
+{
+    long total_bytes = limit / 30 + 1;
+    long count = 0;
+
+    long active = 0;
+    for (long segment = first; segment < last; segment += segment_bytes) {
+        long length = last - segment < segment_bytes ? last - segment : segment_bytes;
+
+        /* Only primes up to the square root of the end of the segment have multiples to cross off in it. Each is
+           started at the segment its square falls in, so its offsets are never longer than a segment, however
+           long the chunk. */
+        uint64_t end = (uint64_t)(segment + length) * 30;
+        long started = active;
+        while (active < num_primes && (uint64_t)primes[active].prime * primes[active].prime < end) {
+            active++;
+        }
+        prime_sieve_start(primes + started, active - started, segment);
+
+        prime_sieve_segment(sieve, segment, length, pattern, primes, active);
+
+        if (segment == 0) {
+            /* 1 is not a prime, but 7, 11, 13 and 17 are */
+            sieve[0] &= (uint8_t)~1u;
+            for (int i = 0; i < 4; ++i) {
+                sieve[0] |= (uint8_t)(1u << PRIME_SIEVE_BIT[PRIME_SIEVE_PRESIEVED[i]]);
+            }
+        }
+        if (segment + length == total_bytes) {
+            /* Clear the bits for the numbers after limit in the last byte */
+            long base = (total_bytes - 1) * 30;
+            for (int c = 0; c < 8; ++c) {
+                if (base + PRIME_SIEVE_RESIDUES[c] > limit) {
+                    sieve[length - 1] &= (uint8_t)~(1u << c);
+                }
+            }
+        }
+        count += prime_sieve_popcount(sieve, length);
+    }
+
+    /* 2, 3 and 5 aren't in the sieve, so are counted with the first chunk */
+    if (first == 0) {
+        count += (limit >= 2) + (limit >= 3) + (limit >= 5);
+    }
+    return count;
+}
+
+/* Count the primes up to and including limit in the chunks of segments
+ * taken by this rank, which are at least chunk_segments segments for each
+ * thread. All ranks in comm must call this together. */
+static inline long prime_sieve_count(long limit, long segment_bytes, int chunk_segments,
+                                     enum task_farm_schedule schedule, MPI_Comm comm, struct task_farm_stats *stats)
+{
+    long total_bytes = limit / 30 + 1;
+    long num_segments = (total_bytes + segment_bytes - 1) / segment_bytes;
+
+    int num_threads = 1;
+#ifdef _OPENMP
+    num_threads = omp_get_max_threads();
+#endif
+
+    /* Each thread has its own segment, and its own copy of the offsets of the sieving primes */
+    struct prime_sieve_prime *small_primes;
+    long num_primes = prime_sieve_small_primes(limit, &small_primes);
+    uint8_t *pattern = prime_sieve_pattern();
+    struct prime_sieve_prime **primes = malloc(num_threads * sizeof(*primes));
+    uint8_t **sieves = malloc(num_threads * sizeof(*sieves));
+    for (int t = 0; t < num_threads; ++t) {
+        primes[t] = malloc((num_primes + 1) * sizeof(struct prime_sieve_prime));
+        sieves[t] = malloc(segment_bytes);
+        if (primes[t] == NULL || sieves[t] == NULL) {
+            fprintf(stderr, "Could not allocate a segment of %ld bytes\n", segment_bytes);
+            MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+        }
+        memcpy(primes[t], small_primes, num_primes * sizeof(struct prime_sieve_prime));
+    }
+
+    struct task_farm farm;
+    task_farm_create(&farm, num_segments, schedule, (long)chunk_segments * num_threads, comm);
+
+    long count = 0;
+    long first_segment = 0, last_segment = 0;
+    while (task_farm_next(&farm, &first_segment, &last_segment)) {
+        /* Give each thread a contiguous part of the chunk, so it only has to find where the multiples start once */
+        long num_chunk_segments = last_segment - first_segment;
+#ifdef _OPENMP
+#pragma omp parallel reduction(+ : count)
+#endif
+        {
+            int thread = 0, threads = 1;
+#ifdef _OPENMP
+            thread = omp_get_thread_num();
+            threads = omp_get_num_threads();
+#endif
+            long first = (first_segment + partition_start(num_chunk_segments, thread, threads)) * segment_bytes;
+            long last = first + partition_count(num_chunk_segments, thread, threads) * segment_bytes;
+            last = last < total_bytes ? last : total_bytes;
+            if (first < last) {
+                count += prime_sieve_chunk(limit, first, last, segment_bytes, sieves[thread], pattern,
+                                           primes[thread], num_primes);
+            }
+        }
+    }
+
+    task_farm_finish(&farm);
+    *stats = farm.stats;
+
+    for (int t = 0; t < num_threads; ++t) {
+        free(primes[t]);
+        free(sieves[t]);
+    }
+    free(primes);
+    free(sieves);
+    free(small_primes);
+    free(pattern);
+
+    return count;
+}
+
+#endif
@@ -0,0 +1,228 @@
+/*
+ * progress.h - reporting the progress of a long OpenMP loop without slowing
+ * it down
+ *
+ * Each thread counts its own iterations in a counter on a cache line of its
+ * own, and a monitor thread adds them up every interval seconds and prints
+ * how far the loop has got, e.g.
+ *
+ *   struct progress progress;
+ *   progress_create(&progress, "update", n, 1.0);
+ *   #pragma omp parallel
+ *   {
+ *       struct cache_line_counter *counter = progress_local(&progress);
+ *       #pragma omp for
+ *       for (long i = 0; i < n; i++) {
+ *           ...
+ *           progress_add(counter, 1);
+ *       }
+ *   }
+ *   progress_finish(&progress);
+ *   progress_report(&progress, stdout);
+ *   progress_destroy(&progress);
+ *
+ * which prints lines like
+ *
+ *   update: 42.0% (420000 of 1000000), 2.1e+05 per second, 2.8 s left
+ *
+ * The monitor may see a count slightly out of date, but never a torn one,
+ * and never calls MPI. To count over the ranks of MPI_COMM_WORLD, define
+ * PROGRESS_MPI before including this. Then only rank 0 prints while the
+ * loop runs, and progress_report(), which every rank must call, adds up
+ * every rank's counts. Without it each process counts and prints on its
+ * own. Compile with -fopenmp -pthread.
+ */
+
+#ifndef PROGRESS_H
+#define PROGRESS_H
+
+#include <omp.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef PROGRESS_MPI
+#include <mpi.h>
+#endif
+
+#include "cache_line.h"
+
+#define PROGRESS_NAME_LENGTH 64
+
+struct progress {
+    char name[PROGRESS_NAME_LENGTH];
+    long total;       /* iterations expected on this rank */
+    double interval;  /* seconds between reports, 0 for none */
+    int num_threads;
+    struct cache_line_counter *counters;
+    double start;
+    double elapsed;   /* set by progress_finish() */
+    int rank;         /* in MPI_COMM_WORLD with PROGRESS_MPI, otherwise 0 */
+    int monitoring;   /* whether the monitor thread was started */
+    int finished;
+    pthread_t monitor;
+    pthread_mutex_t mutex;
+    pthread_cond_t wake;
+};
+
+/* The calling thread's own counter, to pass to progress_add() */
+static inline struct cache_line_counter *progress_local(struct progress *progress)
+{
+    int thread = omp_get_thread_num();
+    if (thread >= progress->num_threads) {
+        fprintf(stderr, "Thread %d has no progress counter, there are only %d\n", thread, progress->num_threads);
+        exit(EXIT_FAILURE);
+    }
+    return &progress->counters[thread];
+}
+
+/* Count n more iterations done by the thread which owns counter, returning
+ * how many it has done in all */
+static inline long progress_add(struct cache_line_counter *counter, long n)
+{
+    /* Only the owner writes its counter, so reading it needs no atomic */
+    long count = counter->value + n;
+#pragma omp atomic write
+    counter->value = count;
+    return count;
+}
+
+/* The iterations done so far by every thread, as far as this thread can see */
+static inline long progress_count(const struct progress *progress)
+{
+    long done = 0;
+    for (int thread = 0; thread < progress->num_threads; ++thread) {
+        long count;
+#pragma omp atomic read
+        count = progress->counters[thread].value;
+        done += count;
+    }
+    return done;
+}
+
+static inline void progress_print(const struct progress *progress, FILE *out, long done, long total,
+                                  double elapsed)
+{
+    double rate = elapsed > 0.0 ? done / elapsed : 0.0;
+    fprintf(out, "%s: %.1f%% (%ld of %ld), %.2g per second", progress->name,
+            total > 0 ? 100.0 * done / total : 100.0, done, total, rate);
+    if (done < total && rate > 0.0) {
+        fprintf(out, ", %.1f s left\n", (total - done) / rate);
+    } else {
+        fprintf(out, ", %.1f s in total\n", elapsed);
+    }
+    fflush(out);
+}
+
+/* The monitor thread, which sleeps until the next report is due or the
+ * loop finishes */
+static inline void *progress_monitor(void *argument)
+{
+    struct progress *progress = argument;
+    struct timespec wake_at;
+    clock_gettime(CLOCK_REALTIME, &wake_at);
+
+    pthread_mutex_lock(&progress->mutex);
+    while (!progress->finished) {
+        long nanoseconds = wake_at.tv_nsec + (long)(1e9 * progress->interval);
+        wake_at.tv_sec += nanoseconds / 1000000000L;
+        wake_at.tv_nsec = nanoseconds % 1000000000L;
+        while (!progress->finished &&
+               pthread_cond_timedwait(&progress->wake, &progress->mutex, &wake_at) == 0) {
+            /* Woken early, either to finish or spuriously */
+        }
+        if (!progress->finished) {
+            progress_print(progress, stdout, progress_count(progress), progress->total,
+                           omp_get_wtime() - progress->start);
+        }
+    }
+    pthread_mutex_unlock(&progress->mutex);
+    return NULL;
+}
+
+/* Start counting a loop of total iterations on this rank, printing its
+ * progress every interval seconds, or never if interval is 0. Call outside
+ * the parallel region, which can have up to omp_get_max_threads() threads. */
+static inline void progress_create(struct progress *progress, const char *name, long total, double interval)
+{
+    memset(progress, 0, sizeof(*progress));
+    snprintf(progress->name, PROGRESS_NAME_LENGTH, "%s", name);
+    progress->total = total;
+    progress->interval = interval;
+    progress->num_threads = omp_get_max_threads();
+    progress->counters = cache_line_alloc(progress->num_threads, sizeof(*progress->counters));
+    if (progress->counters == NULL) {
+        fprintf(stderr, "Could not allocate progress counters for %d threads\n", progress->num_threads);
+        exit(EXIT_FAILURE);
+    }
+    memset(progress->counters, 0, progress->num_threads * sizeof(*progress->counters));
+#ifdef PROGRESS_MPI
+    MPI_Comm_rank(MPI_COMM_WORLD, &progress->rank);
+#endif
+
+    pthread_mutex_init(&progress->mutex, NULL);
+    pthread_cond_init(&progress->wake, NULL);
+    progress->start = omp_get_wtime();
+    if (interval > 0.0 && progress->rank == 0) {
+        progress->monitoring = pthread_create(&progress->monitor, NULL, progress_monitor, progress) == 0;
+        if (!progress->monitoring) {
+            fprintf(stderr, "Could not start a thread to monitor %s, so its progress won't be shown\n", name);
+        }
+    }
+}
+
+/* Stop the clock and the monitor thread once the loop is done */
+static inline void progress_finish(struct progress *progress)
+{
+    progress->elapsed = omp_get_wtime() - progress->start;
+    pthread_mutex_lock(&progress->mutex);
+    progress->finished = 1;
+    pthread_cond_signal(&progress->wake);
+    pthread_mutex_unlock(&progress->mutex);
+    if (progress->monitoring) {
+        pthread_join(progress->monitor, NULL);
+        progress->monitoring = 0;
+    }
+}
+
+/* Print the final count, over every rank with PROGRESS_MPI, and how many
+ * iterations each of rank 0's threads did. Call after progress_finish(). */
+static inline void progress_report(const struct progress *progress, FILE *out)
+{
+    long counts[2] = {progress_count(progress), progress->total};
+    double elapsed = progress->elapsed;
+#ifdef PROGRESS_MPI
+    MPI_Allreduce(MPI_IN_PLACE, counts, 2, MPI_LONG, MPI_SUM, MPI_COMM_WORLD);
+    MPI_Allreduce(MPI_IN_PLACE, &elapsed, 1, MPI_DOUBLE, MPI_MAX, MPI_COMM_WORLD);
+#endif
+    if (progress->rank != 0) {
+        return;
+    }
+
+    progress_print(progress, out, counts[0], counts[1], elapsed);
+    long most = 0;
+    fprintf(out, "%s: iterations by thread", progress->name);
+    for (int thread = 0; thread < progress->num_threads; ++thread) {
+        long count = progress->counters[thread].value;
+        most = count > most ? count : most;
+        fprintf(out, " %ld", count);
+    }
+    long done = progress_count(progress);
+    fprintf(out, ", busiest thread %.2fx the mean\n",
+            done > 0 ? (double)most * progress->num_threads / done : 1.0);
+}
+
+static inline void progress_destroy(struct progress *progress)
+{
+    if (progress->monitoring) {
+        progress_finish(progress);
+    }
+    pthread_mutex_destroy(&progress->mutex);
+    pthread_cond_destroy(&progress->wake);
+    free(progress->counters);
+    progress->counters = NULL;
+}
+
+#endif
@@ -0,0 +1,285 @@
+/*
+ * schedule_tuner.h - choosing the schedule of an OpenMP loop by timing it
+ *
+ * A schedule(runtime) loop that runs many times tries static, dynamic and
+ * guided with a range of chunk sizes in its first runs, each
+ * SCHEDULE_TUNER_TRIALS times, and then keeps the fastest. With a cache
+ * file the choice is saved for the loop and number of threads, as lines of
+ *
+ *   <loop name> <threads> <schedule> <chunk size> <seconds>
+ *
+ * and the next run starts with it; deleting a line tunes that loop again.
+ * Each run of the loop is bracketed with schedule_tuner_begin() and
+ * schedule_tuner_end(), e.g.
+ *
+ *   struct schedule_tuner tuner;
+ *   schedule_tuner_create(&tuner, "unbalanced_loop", n, "schedule-cache.txt");
+ *   for (int step = 0; step < num_steps; ++step) {
+ *       schedule_tuner_begin(&tuner);
+ *       #pragma omp parallel for schedule(runtime)
+ *       for (int i = 0; i < n; i++) { ... }
+ *       schedule_tuner_end(&tuner);
+ *   }
+ *   schedule_tuner_report(&tuner, stdout);
+ *
+ * Compile with -fopenmp.
+ */
+
+#ifndef SCHEDULE_TUNER_H
+#define SCHEDULE_TUNER_H
+
+#include <omp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SCHEDULE_TUNER_MAX_CANDIDATES 32
+#define SCHEDULE_TUNER_NAME_LENGTH 64
+#define SCHEDULE_TUNER_TRIALS 2
+
+struct schedule_candidate {
+    omp_sched_t kind;
+    int chunk_size; /* 0 for the default */
+    int trials;
+    double seconds; /* the fastest trial */
+};
+
+struct schedule_tuner {
+    char name[SCHEDULE_TUNER_NAME_LENGTH];
+    const char *cache_path; /* NULL or "" for no cache */
+    int num_threads;
+    int num_candidates;
+    struct schedule_candidate candidates[SCHEDULE_TUNER_MAX_CANDIDATES];
+    int current; /* the candidate being tried, or chosen */
+    int chosen;  /* whether the tuning is finished */
+    int from_cache;
+    double start;
+};
+
+static inline const char *schedule_kind_name(omp_sched_t kind)
+{
+    switch (kind) {
+    case omp_sched_static:
+        return "static";
+    case omp_sched_dynamic:
+        return "dynamic";
+    case omp_sched_guided:
+        return "guided";
+    default:
+        return "auto";
+    }
+}
+
+static inline omp_sched_t schedule_kind_from_name(const char *name)
+{
+    if (strcmp(name, "static") == 0) {
+        return omp_sched_static;
+    }
+    if (strcmp(name, "dynamic") == 0) {
+        return omp_sched_dynamic;
+    }
+    if (strcmp(name, "guided") == 0) {
+        return omp_sched_guided;
+    }
+    return omp_sched_auto;
+}
+
+static inline void schedule_tuner_add(struct schedule_tuner *tuner, omp_sched_t kind, int chunk_size)
+{
+    if (tuner->num_candidates < SCHEDULE_TUNER_MAX_CANDIDATES) {
+        struct schedule_candidate *candidate = &tuner->candidates[tuner->num_candidates++];
+        candidate->kind = kind;
+        candidate->chunk_size = chunk_size;
+        candidate->trials = 0;
+        candidate->seconds = 0.0;
+    }
+}
+
+/* Look for this loop and number of threads in the cache file, returning
+ * whether it was found */
+static inline int schedule_tuner_load(struct schedule_tuner *tuner)
+{
+    FILE *cache = tuner->cache_path && tuner->cache_path[0] ? fopen(tuner->cache_path, "r") : NULL;
+    if (cache == NULL) {
+        return 0;
+    }
+
+    char line[256], name[SCHEDULE_TUNER_NAME_LENGTH], kind[16];
+    int threads, chunk_size, found = 0;
+    double seconds;
+    while (fgets(line, sizeof(line), cache)) {
+        if (sscanf(line, "%63s %d %15s %d %lf", name, &threads, kind, &chunk_size, &seconds) == 5 &&
+            strcmp(name, tuner->name) == 0 && threads == tuner->num_threads) {
+            /* The last entry wins, as it's the most recent */
+            tuner->num_candidates = 0;
+            schedule_tuner_add(tuner, schedule_kind_from_name(kind), chunk_size);
+            tuner->candidates[0].trials = 1;
+            tuner->candidates[0].seconds = seconds;
+            found = 1;
+        }
+    }
+
+    fclose(cache);
+    return found;
+}
+
+/* Write the chosen schedule to the cache file, replacing any earlier entry
+ * for this loop and number of threads */
+static inline void schedule_tuner_save(const struct schedule_tuner *tuner)
+{
+    if (tuner->cache_path == NULL || tuner->cache_path[0] == '\0') {
+        return;
+    }
+
+    /* Keep the other lines of the file */
+    char *kept = NULL;
+    size_t kept_length = 0;
+    FILE *cache = fopen(tuner->cache_path, "r");
+    if (cache != NULL) {
+        char line[256], name[SCHEDULE_TUNER_NAME_LENGTH];
+        int threads;
+        while (fgets(line, sizeof(line), cache)) {
+            if (sscanf(line, "%63s %d", name, &threads) == 2 && strcmp(name, tuner->name) == 0 &&
+                threads == tuner->num_threads) {
+                continue;
+            }
+            size_t length = strlen(line);
+            char *grown = realloc(kept, kept_length + length + 1);
+            if (grown == NULL) {
+                break;
+            }
+            kept = grown;
+            memcpy(kept + kept_length, line, length + 1);
+            kept_length += length;
+        }
+        fclose(cache);
+    }
+
+    cache = fopen(tuner->cache_path, "w");
+    if (cache == NULL) {
+        fprintf(stderr, "Could not write the schedule cache %s\n", tuner->cache_path);
+        free(kept);
+        return;
+    }
+    if (kept != NULL) {
+        fputs(kept, cache);
+    }
+    const struct schedule_candidate *best = &tuner->candidates[tuner->current];
+    fprintf(cache, "%s %d %s %d %.6g\n", tuner->name, tuner->num_threads, schedule_kind_name(best->kind),
+            best->chunk_size, best->seconds);
+    fclose(cache);
+    free(kept);
+}
+
+/* Get ready to tune the loop called name, with num_iterations iterations,
+ * which sets the largest chunk size tried */
+static inline void schedule_tuner_create(struct schedule_tuner *tuner, const char *name, long num_iterations,
+                                         const char *cache_path)
+{
+    memset(tuner, 0, sizeof(*tuner));
+    snprintf(tuner->name, SCHEDULE_TUNER_NAME_LENGTH, "%s", name);
+    /* The name is read back with %s, so mustn't hold spaces */
+    for (char *c = tuner->name; *c != '\0'; ++c) {
+        if (*c == ' ' || *c == '\t') {
+            *c = '_';
+        }
+    }
+    tuner->cache_path = cache_path;
+    tuner->num_threads = omp_get_max_threads();
+
+    if (schedule_tuner_load(tuner)) {
+        tuner->chosen = 1;
+        tuner->from_cache = 1;
+        return;
+    }
+
+    /* Static with the default of one block per thread, then chunks from one
+       iteration up to a quarter of each thread's share, so there are still
+       several chunks per thread to even out */
+    long largest = num_iterations / (4 * tuner->num_threads);
+    schedule_tuner_add(tuner, omp_sched_static, 0);
+    for (long chunk_size = 1; chunk_size == 1 || chunk_size <= largest; chunk_size *= 4) {
+        schedule_tuner_add(tuner, omp_sched_static, (int)chunk_size);
+        schedule_tuner_add(tuner, omp_sched_dynamic, (int)chunk_size);
+        schedule_tuner_add(tuner, omp_sched_guided, (int)chunk_size);
+    }
+}
+
+/* Set the schedule for the next run of the loop and start timing it */
+static inline void schedule_tuner_begin(struct schedule_tuner *tuner)
+{
+    const struct schedule_candidate *candidate = &tuner->candidates[tuner->current];
+    omp_set_schedule(candidate->kind, candidate->chunk_size);
+    tuner->start = omp_get_wtime();
+}
+
+/* Record the time of the run which just finished and, while still tuning,
+ * move on to the next candidate, choosing the fastest after the last */
+static inline void schedule_tuner_end(struct schedule_tuner *tuner)
+{
+    double seconds = omp_get_wtime() - tuner->start;
+    if (tuner->chosen) {
+        return;
+    }
+
+    struct schedule_candidate *candidate = &tuner->candidates[tuner->current];
+    if (candidate->trials == 0 || seconds < candidate->seconds) {
+        candidate->seconds = seconds;
+    }
+    candidate->trials++;
+
+    /* Try the candidates in turn, then go round again for the next trial,
+       so anything else slowing the machine down is spread between them */
+    if (++tuner->current < tuner->num_candidates) {
+        return;
+    }
+    tuner->current = 0;
+    if (candidate->trials < SCHEDULE_TUNER_TRIALS) {
+        return;
+    }
+
+    for (int i = 1; i < tuner->num_candidates; ++i) {
+        if (tuner->candidates[i].seconds < tuner->candidates[tuner->current].seconds) {
+            tuner->current = i;
+        }
+    }
+    tuner->chosen = 1;
+    schedule_tuner_save(tuner);
+}
+
+/* Print a schedule as it would be written in the schedule clause */
+static inline void schedule_print(FILE *out, omp_sched_t kind, int chunk_size)
+{
+    if (chunk_size > 0) {
+        fprintf(out, "schedule(%s, %d)", schedule_kind_name(kind), chunk_size);
+    } else {
+        fprintf(out, "schedule(%s)", schedule_kind_name(kind));
+    }
+}
+
+/* Print the time of every candidate tried, and the one chosen */
+static inline void schedule_tuner_report(const struct schedule_tuner *tuner, FILE *out)
+{
+    const struct schedule_candidate *best = &tuner->candidates[tuner->current];
+    if (tuner->from_cache) {
+        fprintf(out, "%s on %d threads: ", tuner->name, tuner->num_threads);
+        schedule_print(out, best->kind, best->chunk_size);
+        fprintf(out, " from %s, %f s when tuned\n", tuner->cache_path, best->seconds);
+        return;
+    }
+
+    for (int i = 0; i < tuner->num_candidates; ++i) {
+        const struct schedule_candidate *candidate = &tuner->candidates[i];
+        if (candidate->trials > 0) {
+            fprintf(out, "%s on %d threads: ", tuner->name, tuner->num_threads);
+            schedule_print(out, candidate->kind, candidate->chunk_size);
+            fprintf(out, " %f s%s\n", candidate->seconds, tuner->chosen && i == tuner->current ? " (chosen)" : "");
+        }
+    }
+    if (!tuner->chosen) {
+        fprintf(out, "%s on %d threads: still tuning, %d candidates of %d runs each\n", tuner->name,
+                tuner->num_threads, tuner->num_candidates, SCHEDULE_TUNER_TRIALS);
+    }
+}
+
+#endif
@@ -0,0 +1,68 @@
+#!/bin/bash
+
+# Print a Markdown table of the run time, speedup and efficiency at each
+# number of cores, from the CSV file written by a program run with
+# --results <file>.csv (see benchmark.h), e.g.
+#
+#   for np in 1 2 4 8 16; do mpirun -n $np pi.exe --repetitions 5 --results pi.csv; done
+#   ./speedup-table.sh pi.csv
+#
+# The number of cores is the number of ranks times the number of threads,
+# the run time is the median of the repetitions, and the speedup is against
+# the run with the fewest cores. If the file holds several regions, give the
+# one to use as the second argument.
+
+if [ $# -lt 1 ]; then
+  echo "Usage: $0 results.csv [region]" >&2
+  exit 1
+fi
+
+awk -F, -v region="$2" '
+# A header line, which comes first and again whenever the columns change
+$1 == "program" {
+  split("", column)
+  for (i = 1; i <= NF; i++) {
+    column[$i] = i
+  }
+  if (!("median" in column)) {
+    print "No median column in " FILENAME > "/dev/stderr"
+    exit 1
+  }
+  next
+}
+region == "" || $column["region"] == region {
+  ranks = ("ranks" in column) ? $column["ranks"] : 1
+  threads = ("threads" in column) ? $column["threads"] : 1
+  cores = ranks * threads
+  # Keep the fastest of several runs on the same number of cores
+  if (!(cores in time) || $column["median"] < time[cores]) {
+    time[cores] = $column["median"]
+  }
+}
+END {
+  n = 0
+  for (cores in time) {
+    sorted[++n] = cores + 0
+  }
+  for (i = 2; i <= n; i++) {
+    for (j = i; j > 1 && sorted[j - 1] > sorted[j]; j--) {
+      swap = sorted[j]; sorted[j] = sorted[j - 1]; sorted[j - 1] = swap
+    }
+  }
+  if (n == 0) {
+    exit
+  }
+
+  print "| Cores (n) | Run Time (s) | Speedup | Efficiency |"
+  print "| --------- | ------------ | ------- | ---------- |"
+  base = sorted[1]
+  for (i = 1; i <= n; i++) {
+    cores = sorted[i]
+    speedup = time[base] / time[cores]
+    if (i == 1) {
+      printf "| %-9d | %-12.6f | -       | -          |\n", cores, time[cores]
+    } else {
+      printf "| %-9d | %-12.6f | %-7.2f | %-10.2f |\n", cores, time[cores], speedup, speedup * base / cores
+    }
+  }
+}' "$1"
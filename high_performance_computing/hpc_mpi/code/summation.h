@@ -0,0 +1,260 @@
+/*
+ * summation.h - adding up many terms accurately, and the same way in
+ * parallel
+ *
+ * A struct summation adds up blocks of terms in one of three modes:
+ *
+ *   - SUM_NAIVE: one running total, as a plain loop would
+ *   - SUM_PAIRWISE: the totals of the blocks are added in pairs, so the
+ *     error grows with log2(number of blocks)
+ *   - SUM_COMPENSATED: keeps the rounding error of every addition and adds
+ *     it back at the end, so the result is almost always the correctly
+ *     rounded total, however the terms are split up
+ *
+ * Threads merge their totals with reduction(summation : total) and ranks
+ * with summation_reduce(), which is only defined when mpi.h is included
+ * first, e.g.
+ *
+ *   struct summation total = summation_create(SUM_COMPENSATED);
+ *   #pragma omp parallel for reduction(summation : total)
+ *   for (long block = 0; block < num_blocks; ++block) {
+ *       double terms[SUM_BLOCK];
+ *       ...
+ *       summation_add(&total, terms, SUM_BLOCK);
+ *   }
+ *   double sum = summation_reduce(&total, 0, MPI_COMM_WORLD);
+ *
+ * Don't compile with -ffast-math, which can simplify the compensation away.
+ */
+
+#ifndef SUMMATION_H
+#define SUMMATION_H
+
+#include <string.h>
+
+#define SUM_LANES 8
+/* The number of terms added at once: big enough to vectorise well, small
+ * enough to stay in cache */
+#define SUM_BLOCK 1024
+/* Enough levels of pairs for 2^64 blocks */
+#define SUM_PAIRWISE_LEVELS 64
+
+enum sum_mode { SUM_NAIVE, SUM_PAIRWISE, SUM_COMPENSATED };
+
+struct summation {
+    enum sum_mode mode;
+    double sum;          /* the total, or for pairwise, the total of the partial sums */
+    double compensation; /* the rounding errors of the compensated total */
+    long blocks;         /* added so far, for pairwise */
+    double levels[SUM_PAIRWISE_LEVELS];
+};
+
+/* Parse the name of a mode, returning -1 for an unknown one */
+static inline int sum_mode_from_name(const char *name)
+{
+    if (strcmp(name, "naive") == 0) {
+        return SUM_NAIVE;
+    }
+    if (strcmp(name, "pairwise") == 0) {
+        return SUM_PAIRWISE;
+    }
+    if (strcmp(name, "compensated") == 0) {
+        return SUM_COMPENSATED;
+    }
+    return -1;
+}
+
+static inline struct summation summation_create(enum sum_mode mode)
+{
+    struct summation total;
+    memset(&total, 0, sizeof(total));
+    total.mode = mode;
+    return total;
+}
+
+/* Add x to the compensated total (sum, compensation) */
+static inline void compensated_add(double *sum, double *compensation, double x)
+{
+    /* Knuth's TwoSum finds the exact rounding error of sum + x. It gives the
+       same error as Neumaier's test of which of the two is bigger, but
+       without a branch, so it vectorises. */
+    double t = *sum + x;
+    double z = t - *sum;
+    *compensation += (*sum - (t - z)) + (x - z);
+    *sum = t;
+}
+
+/* Add one pairwise partial sum, carrying up through the levels like adding
+ * one to a binary counter */
+static inline void pairwise_add(struct summation *total, double x)
+{
+    int level = 0;
+    while (total->blocks >> level & 1) {
+        x += total->levels[level];
+        level++;
+    }
+    total->levels[level] = x;
+    total->blocks++;
+}
+
+/* The total of n terms, added in SUM_LANES separate totals which are then
+ * added in pairs. The lanes don't depend on each other, so vectorise. */
+static inline double lanes_sum(const double *x, long n)
+{
+    double sums[SUM_LANES] = {0.0};
+    long whole = n / SUM_LANES * SUM_LANES;
+
+    for (long i = 0; i < whole; i += SUM_LANES) {
+        for (int lane = 0; lane < SUM_LANES; ++lane) {
+            sums[lane] += x[i + lane];
+        }
+    }
+    for (long i = whole; i < n; ++i) {
+        sums[0] += x[i];
+    }
+    for (int width = SUM_LANES / 2; width > 0; width /= 2) {
+        for (int lane = 0; lane < width; ++lane) {
+            sums[lane] += sums[lane + width];
+        }
+    }
+    return sums[0];
+}
+
+/* Add up n <= SUM_BLOCK terms in pairs, then the pairs in pairs, and so on,
+ * finding the exact rounding error of every addition with TwoSum. The
+ * additions at each level are independent of each other, so they vectorise,
+ * which a single running compensated total would not. */
+static inline void compensated_block(const double *x, long n, double *sum, double *error)
+{
+    double pairs[2][SUM_BLOCK / 2 + 1], errors[SUM_BLOCK / 2];
+    const double *from = x;
+    double total_error = 0.0;
+
+    for (int level = 0; n > 1; ++level) {
+        double *to = pairs[level % 2];
+        long half = n / 2;
+        for (long j = 0; j < half; ++j) {
+            double a = from[2 * j], b = from[2 * j + 1];
+            double t = a + b;
+            double z = t - a;
+            errors[j] = (a - (t - z)) + (b - z);
+            to[j] = t;
+        }
+        if (n % 2) {
+            to[half] = from[n - 1];
+        }
+        total_error += lanes_sum(errors, half);
+        from = to;
+        n = half + n % 2;
+    }
+
+    *sum = n == 1 ? from[0] : 0.0;
+    *error = total_error;
+}
+
+/* Add n terms */
+static inline void summation_add(struct summation *total, const double *x, long n)
+{
+    for (long start = 0; start < n; start += SUM_BLOCK) {
+        long length = n - start < SUM_BLOCK ? n - start : SUM_BLOCK;
+        double sum, error;
+
+        switch (total->mode) {
+        case SUM_COMPENSATED:
+            compensated_block(x + start, length, &sum, &error);
+            compensated_add(&total->sum, &total->compensation, sum);
+            total->compensation += error;
+            break;
+        case SUM_PAIRWISE:
+            pairwise_add(total, lanes_sum(x + start, length));
+            break;
+        default:
+            total->sum += lanes_sum(x + start, length);
+            break;
+        }
+    }
+}
+
+/* The total so far */
+static inline double summation_value(const struct summation *total)
+{
+    switch (total->mode) {
+    case SUM_PAIRWISE: {
+        double sum = 0.0;
+        for (int level = 0; level < SUM_PAIRWISE_LEVELS; ++level) {
+            if (total->blocks >> level & 1) {
+                sum += total->levels[level];
+            }
+        }
+        return sum;
+    }
+    case SUM_COMPENSATED:
+        return total->sum + total->compensation;
+    default:
+        return total->sum;
+    }
+}
+
+/* Add the total from another thread or rank into this one */
+static inline void summation_merge(struct summation *into, const struct summation *from)
+{
+    switch (into->mode) {
+    case SUM_PAIRWISE:
+        pairwise_add(into, summation_value(from));
+        break;
+    case SUM_COMPENSATED:
+        compensated_add(&into->sum, &into->compensation, from->sum);
+        into->compensation += from->compensation;
+        break;
+    default:
+        into->sum += from->sum;
+        break;
+    }
+}
+
+#ifdef _OPENMP
+#pragma omp declare reduction(summation : struct summation : summation_merge(&omp_out, &omp_in))                     \
+    initializer(omp_priv = summation_create(omp_orig.mode))
+#endif
+
+#ifdef MPI_VERSION
+/* Adds up (sum, compensation) pairs, for MPI_Op_create() */
+static void summation_compensated_op(void *in, void *inout, int *count, MPI_Datatype *type)
+{
+    const double *from = in;
+    double *into = inout;
+    (void)type;
+    for (int i = 0; i < *count; ++i) {
+        compensated_add(&into[2 * i], &into[2 * i + 1], from[2 * i]);
+        into[2 * i + 1] += from[2 * i + 1];
+    }
+}
+
+/* Add up the totals of every rank in comm, returning the result on root */
+static inline double summation_reduce(const struct summation *total, int root, MPI_Comm comm)
+{
+    double result = 0.0;
+
+    if (total->mode == SUM_COMPENSATED) {
+        MPI_Datatype pair;
+        MPI_Op op;
+        MPI_Type_contiguous(2, MPI_DOUBLE, &pair);
+        MPI_Type_commit(&pair);
+        MPI_Op_create(summation_compensated_op, 1, &op);
+
+        double local[2] = {total->sum, total->compensation}, reduced[2] = {0.0, 0.0};
+        MPI_Reduce(local, reduced, 1, pair, op, root, comm);
+        result = reduced[0] + reduced[1];
+
+        MPI_Op_free(&op);
+        MPI_Type_free(&pair);
+    } else {
+        double local = summation_value(total);
+        MPI_Reduce(&local, &result, 1, MPI_DOUBLE, MPI_SUM, root, comm);
+    }
+
+    return result;
+}
+#endif
+
+#endif
@@ -0,0 +1,222 @@
+/*
+ * task_farm.h - handing out work to ranks as they become free
+ *
+ * The items [0, num_items) are given out in chunks, and each rank asks for
+ * another when it finishes one. The next chunk is taken with
+ * MPI_Fetch_and_op() on a window on rank 0, which carries on working too.
+ * The schedules are like OpenMP's: TASK_FARM_STATIC, one range per rank,
+ * TASK_FARM_DYNAMIC, chunks of chunk_size, and TASK_FARM_GUIDED, chunks
+ * which shrink to chunk_size. Every rank runs the same loop, e.g.
+ *
+ *   struct task_farm farm;
+ *   task_farm_create(&farm, num_items, TASK_FARM_GUIDED, 100, MPI_COMM_WORLD);
+ *   long first = 0, last = 0;
+ *   while (task_farm_next(&farm, &first, &last)) {
+ *       for (long i = first; i < last; ++i) { ... }
+ *   }
+ *   task_farm_finish(&farm);
+ *   task_farm_report(&farm.stats, MPI_COMM_WORLD);
+ *
+ * task_farm_report() prints how long each rank was busy and idle.
+ */
+
+#ifndef TASK_FARM_H
+#define TASK_FARM_H
+
+#include <mpi.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "partition.h"
+
+enum task_farm_schedule { TASK_FARM_STATIC, TASK_FARM_DYNAMIC, TASK_FARM_GUIDED };
+
+struct task_farm_stats {
+    long chunks; /* taken by this rank */
+    long items;
+    double busy; /* seconds spent working on chunks */
+    double idle; /* seconds spent waiting for chunks, or for other ranks */
+};
+
+struct task_farm {
+    enum task_farm_schedule schedule;
+    MPI_Comm comm;
+    int rank;
+    int num_ranks;
+    long num_items;
+    long chunk_size;
+    long num_chunks;
+    long *chunk_starts; /* for guided chunks, which have different sizes */
+    MPI_Win window;
+    long *next_chunk; /* on rank 0 */
+    int working;      /* whether a chunk has been handed out and not finished */
+    double last_time;
+    struct task_farm_stats stats;
+};
+
+/* Parse the name of a schedule, returning -1 for an unknown one */
+static inline int task_farm_schedule_from_name(const char *name)
+{
+    if (strcmp(name, "static") == 0) {
+        return TASK_FARM_STATIC;
+    }
+    if (strcmp(name, "dynamic") == 0) {
+        return TASK_FARM_DYNAMIC;
+    }
+    if (strcmp(name, "guided") == 0) {
+        return TASK_FARM_GUIDED;
+    }
+    return -1;
+}
+
+/* Get ready to hand out num_items items, which all ranks in comm must do
+ * together */
+static inline void task_farm_create(struct task_farm *farm, long num_items, enum task_farm_schedule schedule,
+                                    long chunk_size, MPI_Comm comm)
+{
+    farm->schedule = schedule;
+    farm->comm = comm;
+    farm->num_items = num_items;
+    farm->chunk_size = chunk_size > 0 ? chunk_size : 1;
+    farm->chunk_starts = NULL;
+    farm->next_chunk = NULL;
+    farm->window = MPI_WIN_NULL;
+    farm->working = 0;
+    memset(&farm->stats, 0, sizeof(farm->stats));
+    MPI_Comm_rank(comm, &farm->rank);
+    MPI_Comm_size(comm, &farm->num_ranks);
+
+    switch (schedule) {
+    case TASK_FARM_STATIC:
+        farm->num_chunks = farm->num_ranks;
+        break;
+    case TASK_FARM_DYNAMIC:
+        farm->num_chunks = (num_items + farm->chunk_size - 1) / farm->chunk_size;
+        break;
+    case TASK_FARM_GUIDED:
+        /* Every rank works out the same list of chunk sizes, so only the chunk index needs to be shared */
+        farm->num_chunks = 0;
+        for (long start = 0; start < num_items; farm->num_chunks++) {
+            long size = (num_items - start + farm->num_ranks - 1) / farm->num_ranks;
+            start += size > farm->chunk_size ? size : farm->chunk_size;
+        }
+        farm->chunk_starts = malloc((farm->num_chunks + 1) * sizeof(long));
+        if (farm->chunk_starts == NULL) {
+            fprintf(stderr, "Could not allocate a list of %ld chunks\n", farm->num_chunks);
+            MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+        }
+        farm->chunk_starts[0] = 0;
+        for (long chunk = 0; chunk < farm->num_chunks; ++chunk) {
+            long start = farm->chunk_starts[chunk];
+            long size = (num_items - start + farm->num_ranks - 1) / farm->num_ranks;
+            size = size > farm->chunk_size ? size : farm->chunk_size;
+            farm->chunk_starts[chunk + 1] = start + size < num_items ? start + size : num_items;
+        }
+        break;
+    }
+
+    if (schedule != TASK_FARM_STATIC) {
+        MPI_Win_allocate(farm->rank == 0 ? sizeof(long) : 0, sizeof(long), MPI_INFO_NULL, comm, &farm->next_chunk,
+                         &farm->window);
+        MPI_Win_lock_all(0, farm->window);
+        if (farm->rank == 0) {
+            /* A plain store only reaches the private copy of the window, so synchronise it with the public copy
+               the other ranks' atomics use, before the barrier lets them start */
+            *farm->next_chunk = 0;
+            MPI_Win_sync(farm->window);
+        }
+    }
+
+    /* Start everyone's clocks together, so waiting for the slowest rank to get here isn't counted as idle */
+    MPI_Barrier(comm);
+    farm->last_time = MPI_Wtime();
+}
+
+/* Finish the last chunk and get the next one, [*first, *last). Returns 0
+ * when there are none left. */
+static inline int task_farm_next(struct task_farm *farm, long *first, long *last)
+{
+    double now = MPI_Wtime();
+    if (farm->working) {
+        farm->stats.busy += now - farm->last_time;
+    }
+
+    long chunk;
+    if (farm->schedule == TASK_FARM_STATIC) {
+        chunk = farm->stats.chunks > 0 ? farm->num_chunks : farm->rank;
+    } else {
+        const long one = 1;
+        MPI_Fetch_and_op(&one, &chunk, MPI_LONG, 0, 0, MPI_SUM, farm->window);
+        MPI_Win_flush(0, farm->window);
+    }
+
+    farm->working = chunk < farm->num_chunks;
+    if (farm->working) {
+        switch (farm->schedule) {
+        case TASK_FARM_STATIC:
+            *first = partition_start(farm->num_items, (int)chunk, farm->num_ranks);
+            *last = *first + partition_count(farm->num_items, (int)chunk, farm->num_ranks);
+            break;
+        case TASK_FARM_DYNAMIC:
+            *first = chunk * farm->chunk_size;
+            *last = *first + farm->chunk_size < farm->num_items ? *first + farm->chunk_size : farm->num_items;
+            break;
+        case TASK_FARM_GUIDED:
+            *first = farm->chunk_starts[chunk];
+            *last = farm->chunk_starts[chunk + 1];
+            break;
+        }
+        farm->stats.chunks++;
+        farm->stats.items += *last - *first;
+    }
+
+    farm->last_time = MPI_Wtime();
+    farm->stats.idle += farm->last_time - now;
+    return farm->working;
+}
+
+/* Wait for every rank to run out of chunks, counting the wait as idle, and
+ * release the farm */
+static inline void task_farm_finish(struct task_farm *farm)
+{
+    double start = MPI_Wtime();
+    MPI_Barrier(farm->comm);
+    farm->stats.idle += MPI_Wtime() - start;
+
+    if (farm->window != MPI_WIN_NULL) {
+        MPI_Win_unlock_all(farm->window);
+        MPI_Win_free(&farm->window);
+    }
+    free(farm->chunk_starts);
+    farm->chunk_starts = NULL;
+}
+
+/* Print the chunks, items, busy and idle time of every rank on rank 0 of
+ * comm, followed by a summary of how well balanced they were */
+static inline void task_farm_report(const struct task_farm_stats *stats, MPI_Comm comm)
+{
+    int rank, num_ranks;
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_size(comm, &num_ranks);
+
+    struct task_farm_stats *all = rank == 0 ? malloc(num_ranks * sizeof(*all)) : NULL;
+    MPI_Gather(stats, sizeof(*stats), MPI_BYTE, all, sizeof(*stats), MPI_BYTE, 0, comm);
+
+    if (rank == 0) {
+        double least_busy = all[0].busy, most_busy = all[0].busy, total_idle = 0.0;
+        for (int r = 0; r < num_ranks; ++r) {
+            printf("Rank %d - %ld chunks, %ld items, busy %.3f s, idle %.3f s\n", r, all[r].chunks, all[r].items,
+                   all[r].busy, all[r].idle);
+            least_busy = all[r].busy < least_busy ? all[r].busy : least_busy;
+            most_busy = all[r].busy > most_busy ? all[r].busy : most_busy;
+            total_idle += all[r].idle;
+        }
+        double elapsed = all[0].busy + all[0].idle;
+        printf("Busy for %.3f to %.3f s, idle for %.1f%% of the %.3f s run\n", least_busy, most_busy,
+               elapsed > 0.0 ? 100.0 * total_idle / (num_ranks * elapsed) : 0.0, elapsed);
+        free(all);
+    }
+}
+
+#endif
@@ -0,0 +1,182 @@
+/*
+ * thread_reduction.h - combining results from OpenMP threads without
+ * contention
+ *
+ * For accumulations a reduction clause can't express, such as a histogram
+ * whose bins are only known at run time. Each thread updates its own
+ * partial of width doubles, on cache lines of its own, with no
+ * synchronisation, and the partials are then merged with an operator such
+ * as thread_reduction_sum(), in a tree when they're narrow and by slices
+ * when they're wide, e.g.
+ *
+ *   struct thread_reduction histogram;
+ *   thread_reduction_create(&histogram, num_bins, thread_reduction_sum, 0.0);
+ *   #pragma omp parallel
+ *   {
+ *       double *bins = thread_reduction_local(&histogram);
+ *       #pragma omp for
+ *       for (long i = 0; i < n; i++) {
+ *           bins[bin_of(x[i])] += 1.0;
+ *       }
+ *       thread_reduction_combine(&histogram);
+ *   }
+ *   const double *result = thread_reduction_result(&histogram);
+ *   ...
+ *   thread_reduction_destroy(&histogram);
+ *
+ * thread_reduction_combine() must be called by every thread of the team,
+ * or outside a parallel region. The partials are always merged in the same
+ * order, so the result is the same from run to run. Compile with -fopenmp.
+ */
+
+#ifndef THREAD_REDUCTION_H
+#define THREAD_REDUCTION_H
+
+#include <omp.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "cache_line.h"
+
+/* Partials at least this many times wider than the number of threads are
+ * merged by slices rather than in a tree */
+#define THREAD_REDUCTION_SLICE_WIDTH 8
+
+/* Merge n values from one partial into another, into[i] = into[i] op from[i] */
+typedef void (*thread_reduction_op)(double *into, const double *from, size_t n);
+
+struct thread_reduction {
+    int num_threads;
+    size_t width;    /* values in each partial */
+    size_t stride;   /* values from the start of one partial to the next */
+    double *partials;
+    thread_reduction_op op;
+    double identity; /* the value each partial starts with */
+};
+
+static inline void thread_reduction_sum(double *into, const double *from, size_t n)
+{
+    for (size_t i = 0; i < n; ++i) {
+        into[i] += from[i];
+    }
+}
+
+static inline void thread_reduction_max(double *into, const double *from, size_t n)
+{
+    for (size_t i = 0; i < n; ++i) {
+        into[i] = from[i] > into[i] ? from[i] : into[i];
+    }
+}
+
+static inline void thread_reduction_min(double *into, const double *from, size_t n)
+{
+    for (size_t i = 0; i < n; ++i) {
+        into[i] = from[i] < into[i] ? from[i] : into[i];
+    }
+}
+
+/* Set every partial back to the identity, each thread touching its own
+ * first so it's placed in memory near that thread. The team may have fewer
+ * threads than there are partials, e.g. when nested or under a thread
+ * limit, so the threads share out any that would otherwise be missed. */
+static inline void thread_reduction_reset(struct thread_reduction *reduction)
+{
+#pragma omp parallel num_threads(reduction->num_threads)
+    {
+        for (int p = omp_get_thread_num(); p < reduction->num_threads; p += omp_get_num_threads()) {
+            double *partial = reduction->partials + p * reduction->stride;
+            for (size_t i = 0; i < reduction->stride; ++i) {
+                partial[i] = reduction->identity;
+            }
+        }
+    }
+}
+
+/* Make room for a partial of width values for each of the threads that a
+ * parallel region would start now */
+static inline void thread_reduction_create(struct thread_reduction *reduction, size_t width, thread_reduction_op op,
+                                           double identity)
+{
+    const size_t line = CACHE_LINE / sizeof(double);
+    reduction->num_threads = omp_get_max_threads();
+    reduction->width = width;
+    reduction->stride = (width + line - 1) / line * line;
+    reduction->op = op;
+    reduction->identity = identity;
+
+    reduction->partials = cache_line_alloc(reduction->num_threads * reduction->stride, sizeof(double));
+    if (reduction->partials == NULL) {
+        fprintf(stderr, "Could not allocate %d partials of %zu values\n", reduction->num_threads, width);
+        exit(EXIT_FAILURE);
+    }
+    thread_reduction_reset(reduction);
+}
+
+/* The calling thread's own partial, to update as it likes */
+static inline double *thread_reduction_local(struct thread_reduction *reduction)
+{
+    int thread = omp_get_thread_num();
+    if (thread >= reduction->num_threads) {
+        fprintf(stderr, "Thread %d has no partial, there are only %d\n", thread, reduction->num_threads);
+        exit(EXIT_FAILURE);
+    }
+    return reduction->partials + thread * reduction->stride;
+}
+
+/* Merge every partial into the first, which thread_reduction_result()
+ * returns. Call from every thread of the team, or outside a parallel
+ * region. */
+static inline void thread_reduction_combine(struct thread_reduction *reduction)
+{
+    const int num_partials = reduction->num_threads;
+    double *partials = reduction->partials;
+    const size_t stride = reduction->stride;
+
+    if (!omp_in_parallel()) {
+        for (int p = 1; p < num_partials; ++p) {
+            reduction->op(partials, partials + p * stride, reduction->width);
+        }
+        return;
+    }
+
+    const int thread = omp_get_thread_num();
+    const int num_threads = omp_get_num_threads();
+#pragma omp barrier
+
+    if (reduction->width >= (size_t)THREAD_REDUCTION_SLICE_WIDTH * num_threads) {
+        /* Each thread merges its slice of the values from every partial */
+        size_t first = reduction->width * thread / num_threads;
+        size_t last = reduction->width * (thread + 1) / num_threads;
+        for (int p = 1; p < num_partials; ++p) {
+            reduction->op(partials + first, partials + p * stride + first, last - first);
+        }
+    } else {
+        /* In round r, partial t merges in partial t + 2^r when t is a
+           multiple of 2^(r + 1), so after log2(partials) rounds the first
+           holds them all. The partials are shared out between the threads
+           when there are fewer threads than partials. */
+        for (int gap = 1; gap < num_partials; gap *= 2) {
+            for (int p = thread * 2 * gap; p < num_partials; p += num_threads * 2 * gap) {
+                if (p + gap < num_partials) {
+                    reduction->op(partials + p * stride, partials + (p + gap) * stride, reduction->width);
+                }
+            }
+#pragma omp barrier
+        }
+    }
+#pragma omp barrier
+}
+
+/* The merged result, of width values, after thread_reduction_combine() */
+static inline const double *thread_reduction_result(const struct thread_reduction *reduction)
+{
+    return reduction->partials;
+}
+
+static inline void thread_reduction_destroy(struct thread_reduction *reduction)
+{
+    free(reduction->partials);
+    reduction->partials = NULL;
+}
+
+#endif
@@ -0,0 +1,124 @@
+/*
+ * wavefront.h - running an iterative row update on one team of threads,
+ * without a barrier between iterations
+ *
+ * wavefront_run() carries out every iteration on one team, each thread
+ * keeping the block of rows partition_start() gives it. The matrix is held
+ * twice: iteration t reads copy t % 2 and writes copy (t + 1) % 2, so after
+ * num_iterations the result is in copy num_iterations % 2. Row i may read
+ * rows i - 1, i and i + 1 of the previous iteration, so instead of a
+ * barrier each thread only waits for the threads holding the rows next to
+ * its block, e.g.
+ *
+ *   void update(int iteration, long row, void *context)
+ *   {
+ *       double ***matrix = context;
+ *       const double *above = matrix[iteration % 2][row - 1];
+ *       ...
+ *       matrix[(iteration + 1) % 2][row][j] = ...;
+ *   }
+ *
+ *   double **matrix[2] = {current, next};
+ *   wavefront_run(num_rows, num_iterations, update, matrix);
+ *
+ * A waiting thread spins for a while before yielding its core, in case
+ * there are more threads than cores. Compile with -fopenmp.
+ */
+
+#ifndef WAVEFRONT_H
+#define WAVEFRONT_H
+
+#include <omp.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache_line.h"
+#include "partition.h"
+
+/* How many times a thread checks a flag before yielding its core */
+#define WAVEFRONT_SPINS 1000
+
+/* Update row of iteration (counting from 0), reading the copy of the
+ * matrix iteration % 2 and writing the other */
+typedef void (*wavefront_update)(int iteration, long row, void *context);
+
+/* Wait until flag, which counts the iterations finished by one end of a
+ * thread's block, shows at least iterations finished */
+static inline void wavefront_wait(struct cache_line_counter *flag, int iterations)
+{
+    for (int spins = 0;; ++spins) {
+        long done;
+#pragma omp atomic read acquire
+        done = flag->value;
+        if (done >= iterations) {
+            return;
+        }
+        if (spins >= WAVEFRONT_SPINS) {
+            sched_yield();
+        }
+    }
+}
+
+/* Carry out num_iterations of update over num_rows rows, on up to
+ * omp_get_max_threads() threads but no more than one per row */
+static inline void wavefront_run(long num_rows, int num_iterations, wavefront_update update, void *context)
+{
+    if (num_rows < 1 || num_iterations < 1) {
+        return;
+    }
+    int max_threads = omp_get_max_threads();
+    if (max_threads > num_rows) {
+        max_threads = (int)num_rows;
+    }
+
+    /* Both ends of every thread's block */
+    struct cache_line_counter *flags = cache_line_alloc(2 * max_threads, sizeof(*flags));
+    if (flags == NULL) {
+        fprintf(stderr, "Could not allocate the flags for %d threads\n", max_threads);
+        exit(EXIT_FAILURE);
+    }
+    memset(flags, 0, 2 * max_threads * sizeof(*flags));
+
+#pragma omp parallel num_threads(max_threads)
+    {
+        const int thread = omp_get_thread_num();
+        const int num_threads = omp_get_num_threads();
+        const long first = partition_start(num_rows, thread, num_threads);
+        const long last = partition_start(num_rows, thread + 1, num_threads) - 1;
+        struct cache_line_counter *first_done = &flags[2 * thread];
+        struct cache_line_counter *last_done = &flags[2 * thread + 1];
+        struct cache_line_counter *above = thread > 0 ? &flags[2 * (thread - 1) + 1] : NULL;
+        struct cache_line_counter *below = thread < num_threads - 1 ? &flags[2 * (thread + 1)] : NULL;
+
+        for (int iteration = 0; iteration < num_iterations; ++iteration) {
+            for (long row = first; row <= last; ++row) {
+                /* The neighbouring row of the previous iteration must be
+                   written before we read it, and read before we overwrite
+                   it in the other copy */
+                if (row == first && above != NULL) {
+                    wavefront_wait(above, iteration);
+                }
+                if (row == last && below != NULL) {
+                    wavefront_wait(below, iteration);
+                }
+
+                update(iteration, row, context);
+
+                if (row == first) {
+#pragma omp atomic write release
+                    first_done->value = iteration + 1;
+                }
+                if (row == last) {
+#pragma omp atomic write release
+                    last_done->value = iteration + 1;
+                }
+            }
+        }
+    }
+
+    free(flags);
+}
+
+#endif
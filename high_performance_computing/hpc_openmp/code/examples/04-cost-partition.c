@@ -0,0 +1,173 @@
+/*
+ * Balancing a triangular loop with a cost model instead of a dynamic schedule.
+ *
+ * Row i of the loop updates n - 1 - i elements, so a static schedule gives
+ * the first thread far more work than the last. A dynamic schedule evens
+ * this out by handing rows to threads as they become free, but every row
+ * costs a trip to a shared counter. As the cost of each row is known before
+ * we start, partition.h can instead give each thread one contiguous range of
+ * rows with the same number of updates, which needs no coordination at all.
+ *
+ * For each number of threads from 1 up to --max-threads, doubling each time,
+ * this times static, dynamic and guided schedules, the cost model
+ * partition, and the same split found from a table of the row costs by
+ * partition_weighted(), e.g.
+ *
+ *   ./cost-partition --n 4000 --max-threads 128 --repetitions 5 --results partition.csv
+ *   ../../../hpc_mpi/code/speedup-table.sh partition.csv cost_model
+ */
+
+#include <math.h>
+#include <omp.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../../../hpc_mpi/code/arralloc_aligned.h"
+#include "../../../hpc_mpi/code/benchmark.h"
+#include "../../../hpc_mpi/code/params.h"
+#include "../../../hpc_mpi/code/partition.h"
+
+static int n;
+static double **a, **b;
+static long *starts; /* of each thread's rows, from partition_weighted() */
+
+static void static_loop(void)
+{
+#pragma omp parallel for schedule(static)
+    for (int i = 0; i < n; i++) {
+        for (int j = n - 1; j > i; j--) {
+            a[i][j] += cos(b[i][j]);
+        }
+    }
+}
+
+static void dynamic_loop(void)
+{
+#pragma omp parallel for schedule(dynamic)
+    for (int i = 0; i < n; i++) {
+        for (int j = n - 1; j > i; j--) {
+            a[i][j] += cos(b[i][j]);
+        }
+    }
+}
+
+static void guided_loop(void)
+{
+#pragma omp parallel for schedule(guided)
+    for (int i = 0; i < n; i++) {
+        for (int j = n - 1; j > i; j--) {
+            a[i][j] += cos(b[i][j]);
+        }
+    }
+}
+
+/* Row i costs n - 1 - i updates, so each thread takes the rows from
+   partition_linear_start() with a = n - 1 and b = -1 */
+static void cost_model_loop(void)
+{
+#pragma omp parallel
+    {
+        const int thread = omp_get_thread_num();
+        const int num_threads = omp_get_num_threads();
+        const long first = partition_linear_start(n, thread, num_threads, n - 1, -1);
+        const long last = partition_linear_start(n, thread + 1, num_threads, n - 1, -1);
+        for (long i = first; i < last; i++) {
+            for (int j = n - 1; j > i; j--) {
+                a[i][j] += cos(b[i][j]);
+            }
+        }
+    }
+}
+
+/* The cost of row i, for partition_weighted() */
+static double row_cost(long i, void *context)
+{
+    (void)context;
+    return n - 1 - i;
+}
+
+/* The same split as cost_model_loop(), but found by adding up the cost of
+   every row, as it would have to be for costs with no formula. The split is
+   worked out once for each number of threads, before the loop is timed. */
+static void weighted_loop(void)
+{
+#pragma omp parallel
+    {
+        const int thread = omp_get_thread_num();
+        for (long i = starts[thread]; i < starts[thread + 1]; i++) {
+            for (int j = n - 1; j > i; j--) {
+                a[i][j] += cos(b[i][j]);
+            }
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    /* --warmup, --repetitions and --results are read by benchmark_create(), see benchmark.h */
+    n = param_long(argc, argv, "n", 4000);
+    const int max_threads = param_long(argc, argv, "max_threads", 128);
+    struct benchmark bench;
+    benchmark_create(&bench, argc, argv);
+    params_print_header(stdout, argv[0]);
+
+    size_t extents[2] = {n, n};
+    a = arralloc_aligned(sizeof(double), 2, extents, 0, ARRALLOC_FIRST_TOUCH);
+    b = arralloc_aligned(sizeof(double), 2, extents, 0, ARRALLOC_FIRST_TOUCH);
+    if (a == NULL || b == NULL) {
+        fprintf(stderr, "Could not allocate two %d x %d matrices\n", n, n);
+        return 1;
+    }
+    starts = malloc((max_threads + 1) * sizeof(*starts));
+    if (starts == NULL) {
+        fprintf(stderr, "Could not allocate the rows of %d threads\n", max_threads);
+        return 1;
+    }
+    for (int i = 0; i < n; i++) {
+        for (int j = 0; j < n; j++) {
+            a[i][j] = 0.0;
+            b[i][j] = 3.142 * (i + j);
+        }
+    }
+
+    const char *names[] = {"static", "dynamic", "guided", "cost_model", "weighted"};
+    void (*loops[])(void) = {static_loop, dynamic_loop, guided_loop, cost_model_loop, weighted_loop};
+    const int num_loops = sizeof(loops) / sizeof(loops[0]);
+
+    printf("%8s %12s %12s %12s %12s %12s %10s\n", "Threads", "Static", "Dynamic", "Guided", "Cost model",
+           "Weighted", "vs dynamic");
+    for (int num_threads = 1; num_threads <= max_threads; num_threads *= 2) {
+        omp_set_num_threads(num_threads);
+        partition_weighted(n, num_threads, row_cost, NULL, starts);
+
+        /* A fresh benchmark for each number of threads, so each line of the
+           results file records the threads it was run with */
+        if (num_threads > 1) {
+            benchmark_create(&bench, argc, argv);
+        }
+        param_record_long("threads", num_threads);
+        while (benchmark_next(&bench)) {
+            for (int loop = 0; loop < num_loops; loop++) {
+                benchmark_start(&bench, names[loop]);
+                loops[loop]();
+                benchmark_stop(&bench, names[loop]);
+            }
+        }
+
+        double median[5];
+        for (int loop = 0; loop < num_loops; loop++) {
+            median[loop] = benchmark_stats(&bench, names[loop]).median;
+        }
+        printf("%8d %12f %12f %12f %12f %12f %9.2fx\n", num_threads, median[0], median[1], median[2], median[3],
+               median[4], median[1] / median[3]);
+        if (bench.results[0] != '\0') {
+            benchmark_write_results(&bench);
+        }
+        benchmark_destroy(&bench);
+    }
+
+    arrfree(a);
+    arrfree(b);
+    free(starts);
+    return 0;
+}
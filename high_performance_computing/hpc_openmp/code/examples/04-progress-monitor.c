@@ -0,0 +1,133 @@
+/*
+ * Reporting the progress of a parallel loop without serialising it.
+ *
+ * The progress tracking solution counts finished iterations in a critical
+ * region, so although the loop is shared between the threads, they spend
+ * most of their time waiting for each other to update the counter. This
+ * times the same loop with no progress reporting at all, with the critical
+ * region, with an atomic shared counter, and with the per-thread counters
+ * and monitor thread of progress.h, which prints the progress of the loop
+ * every --interval seconds, e.g.
+ *
+ *   OMP_NUM_THREADS=8 ./progress-monitor --n 100000000 --interval 0.5 --repetitions 3
+ */
+
+#include <math.h>
+#include <omp.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../../../hpc_mpi/code/benchmark.h"
+#include "../../../hpc_mpi/code/params.h"
+#include "../../../hpc_mpi/code/progress.h"
+
+static long n;
+static double interval;
+static double *array;
+
+static void untracked_loop(void)
+{
+#pragma omp parallel for schedule(static)
+    for (long i = 0; i < n; ++i) {
+        array[i] = log(i + 1) * cos(3.142 * i);
+    }
+}
+
+static void critical_loop(void)
+{
+    long progress = 0;
+    long output_frequency = n / 10;
+#pragma omp parallel for schedule(static)
+    for (long i = 0; i < n; ++i) {
+        array[i] = log(i + 1) * cos(3.142 * i);
+#pragma omp critical
+        {
+            progress++;
+            if (output_frequency > 0 && progress % output_frequency == 0) {
+                printf("critical: %.0f%%\n", 100.0 * progress / n);
+            }
+        }
+    }
+}
+
+static void atomic_loop(void)
+{
+    long progress = 0;
+    long output_frequency = n / 10;
+#pragma omp parallel for schedule(static)
+    for (long i = 0; i < n; ++i) {
+        array[i] = log(i + 1) * cos(3.142 * i);
+        long done;
+#pragma omp atomic capture
+        done = ++progress;
+        if (output_frequency > 0 && done % output_frequency == 0) {
+            printf("atomic: %.0f%%\n", 100.0 * done / n);
+        }
+    }
+}
+
+static void monitored_loop(void)
+{
+    struct progress progress;
+    progress_create(&progress, "monitored", n, interval);
+#pragma omp parallel
+    {
+        struct cache_line_counter *counter = progress_local(&progress);
+#pragma omp for schedule(static)
+        for (long i = 0; i < n; ++i) {
+            array[i] = log(i + 1) * cos(3.142 * i);
+            progress_add(counter, 1);
+        }
+    }
+    progress_finish(&progress);
+    progress_report(&progress, stdout);
+    progress_destroy(&progress);
+}
+
+int main(int argc, char **argv)
+{
+    n = param_long(argc, argv, "n", 20000000);
+    interval = param_double(argc, argv, "interval", 1.0);
+    struct benchmark bench;
+    benchmark_create(&bench, argc, argv);
+    param_record_long("threads", omp_get_max_threads());
+    params_print_header(stdout, argv[0]);
+
+    array = malloc(n * sizeof(double));
+    if (array == NULL) {
+        fprintf(stderr, "Could not allocate an array of %ld values\n", n);
+        return 1;
+    }
+    /* Touch the array first, so the first loop timed doesn't also pay for
+       mapping its pages */
+#pragma omp parallel for schedule(static)
+    for (long i = 0; i < n; ++i) {
+        array[i] = 0.0;
+    }
+
+    const char *names[] = {"untracked", "critical", "atomic", "monitored"};
+    void (*loops[])(void) = {untracked_loop, critical_loop, atomic_loop, monitored_loop};
+    const int num_loops = sizeof(loops) / sizeof(loops[0]);
+
+    while (benchmark_next(&bench)) {
+        for (int loop = 0; loop < num_loops; loop++) {
+            benchmark_start(&bench, names[loop]);
+            loops[loop]();
+            benchmark_stop(&bench, names[loop]);
+        }
+    }
+
+    printf("%ld iterations on %d threads\n", n, omp_get_max_threads());
+    double untracked = benchmark_stats(&bench, "untracked").median;
+    for (int loop = 0; loop < num_loops; loop++) {
+        double median = benchmark_stats(&bench, names[loop]).median;
+        printf("%-10s %12f s  %6.2fx the untracked loop\n", names[loop], median, median / untracked);
+    }
+    if (bench.results[0] != '\0') {
+        benchmark_write_results(&bench);
+    }
+    benchmark_destroy(&bench);
+
+    free(array);
+    return 0;
+}
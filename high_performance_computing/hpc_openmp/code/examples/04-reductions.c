@@ -0,0 +1,219 @@
+/*
+ * Comparing ways of accumulating a result from many threads.
+ *
+ * The race condition solutions protect a shared sum with an atomic or a
+ * lock on every iteration, which makes the threads queue up for the same
+ * cache line. This times the same sum with a critical region, an atomic, a
+ * lock, OpenMP's reduction clause and the padded per-thread partials of
+ * thread_reduction.h, and then a histogram, where each iteration adds to a
+ * bin only known at run time, with an atomic per bin, a lock, an array
+ * reduction and thread_reduction.h, e.g.
+ *
+ *   OMP_NUM_THREADS=8 ./reductions --repetitions 5 --results reductions.csv
+ */
+
+#include <math.h>
+#include <omp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../../../hpc_mpi/code/benchmark.h"
+#include "../../../hpc_mpi/code/params.h"
+#include "../../../hpc_mpi/code/thread_reduction.h"
+
+#define ARRAY_SIZE 524288
+
+static long n;
+static int num_bins;
+static double *array;
+static int *bin_of;
+
+static double sum_critical(void)
+{
+    double sum = 0.0;
+#pragma omp parallel for schedule(static)
+    for (long i = 0; i < n; i++) {
+#pragma omp critical
+        sum += array[i];
+    }
+    return sum;
+}
+
+static double sum_atomic(void)
+{
+    double sum = 0.0;
+#pragma omp parallel for schedule(static)
+    for (long i = 0; i < n; i++) {
+#pragma omp atomic
+        sum += array[i];
+    }
+    return sum;
+}
+
+static double sum_lock(void)
+{
+    double sum = 0.0;
+    omp_lock_t lock;
+    omp_init_lock(&lock);
+#pragma omp parallel for schedule(static)
+    for (long i = 0; i < n; i++) {
+        omp_set_lock(&lock);
+        sum += array[i];
+        omp_unset_lock(&lock);
+    }
+    omp_destroy_lock(&lock);
+    return sum;
+}
+
+static double sum_reduction_clause(void)
+{
+    double sum = 0.0;
+#pragma omp parallel for schedule(static) reduction(+ : sum)
+    for (long i = 0; i < n; i++) {
+        sum += array[i];
+    }
+    return sum;
+}
+
+static double sum_thread_reduction(void)
+{
+    struct thread_reduction sum;
+    thread_reduction_create(&sum, 1, thread_reduction_sum, 0.0);
+#pragma omp parallel
+    {
+        double *partial = thread_reduction_local(&sum);
+#pragma omp for schedule(static)
+        for (long i = 0; i < n; i++) {
+            partial[0] += array[i];
+        }
+        thread_reduction_combine(&sum);
+    }
+    double result = thread_reduction_result(&sum)[0];
+    thread_reduction_destroy(&sum);
+    return result;
+}
+
+static void histogram_atomic(double *bins)
+{
+    memset(bins, 0, num_bins * sizeof(double));
+#pragma omp parallel for schedule(static)
+    for (long i = 0; i < n; i++) {
+#pragma omp atomic
+        bins[bin_of[i]] += array[i];
+    }
+}
+
+static void histogram_lock(double *bins)
+{
+    memset(bins, 0, num_bins * sizeof(double));
+    omp_lock_t lock;
+    omp_init_lock(&lock);
+#pragma omp parallel for schedule(static)
+    for (long i = 0; i < n; i++) {
+        omp_set_lock(&lock);
+        bins[bin_of[i]] += array[i];
+        omp_unset_lock(&lock);
+    }
+    omp_destroy_lock(&lock);
+}
+
+static void histogram_reduction_clause(double *bins)
+{
+    memset(bins, 0, num_bins * sizeof(double));
+#pragma omp parallel for schedule(static) reduction(+ : bins[:num_bins])
+    for (long i = 0; i < n; i++) {
+        bins[bin_of[i]] += array[i];
+    }
+}
+
+static void histogram_thread_reduction(double *bins)
+{
+    struct thread_reduction histogram;
+    thread_reduction_create(&histogram, num_bins, thread_reduction_sum, 0.0);
+#pragma omp parallel
+    {
+        double *partial = thread_reduction_local(&histogram);
+#pragma omp for schedule(static)
+        for (long i = 0; i < n; i++) {
+            partial[bin_of[i]] += array[i];
+        }
+        thread_reduction_combine(&histogram);
+    }
+    memcpy(bins, thread_reduction_result(&histogram), num_bins * sizeof(double));
+    thread_reduction_destroy(&histogram);
+}
+
+int main(int argc, char **argv)
+{
+    n = param_long(argc, argv, "n", ARRAY_SIZE);
+    num_bins = param_long(argc, argv, "bins", 1024);
+    struct benchmark bench;
+    benchmark_create(&bench, argc, argv);
+    param_record_long("threads", omp_get_max_threads());
+    params_print_header(stdout, argv[0]);
+
+    array = malloc(n * sizeof(double));
+    bin_of = malloc(n * sizeof(int));
+    double *bins = malloc(num_bins * sizeof(double));
+    double *expected = calloc(num_bins, sizeof(double));
+    if (array == NULL || bin_of == NULL || bins == NULL || expected == NULL) {
+        fprintf(stderr, "Could not allocate arrays of %ld values\n", n);
+        return 1;
+    }
+    for (long i = 0; i < n; i++) {
+        array[i] = cos(0.001 * i);
+        /* Scatter the values over the bins with a multiplicative hash */
+        bin_of[i] = (int)((unsigned long)i * 2654435761UL % (unsigned long)num_bins);
+        expected[bin_of[i]] += array[i];
+    }
+
+    const char *sum_names[] = {"sum_critical", "sum_atomic", "sum_lock", "sum_reduction_clause",
+                               "sum_thread_reduction"};
+    double (*sums[])(void) = {sum_critical, sum_atomic, sum_lock, sum_reduction_clause, sum_thread_reduction};
+    const char *histogram_names[] = {"histogram_atomic", "histogram_lock", "histogram_reduction_clause",
+                                     "histogram_thread_reduction"};
+    void (*histograms[])(double *) = {histogram_atomic, histogram_lock, histogram_reduction_clause,
+                                      histogram_thread_reduction};
+    const int num_sums = sizeof(sums) / sizeof(sums[0]);
+    const int num_histograms = sizeof(histograms) / sizeof(histograms[0]);
+    double sum_results[5], histogram_errors[4];
+
+    while (benchmark_next(&bench)) {
+        for (int s = 0; s < num_sums; s++) {
+            benchmark_start(&bench, sum_names[s]);
+            sum_results[s] = sums[s]();
+            benchmark_stop(&bench, sum_names[s]);
+        }
+        for (int h = 0; h < num_histograms; h++) {
+            benchmark_start(&bench, histogram_names[h]);
+            histograms[h](bins);
+            benchmark_stop(&bench, histogram_names[h]);
+
+            histogram_errors[h] = 0.0;
+            for (int bin = 0; bin < num_bins; bin++) {
+                histogram_errors[h] = fmax(histogram_errors[h], fabs(bins[bin] - expected[bin]));
+            }
+        }
+    }
+
+    printf("Summing %ld values, and adding them to %d bins, on %d threads\n", n, num_bins, omp_get_max_threads());
+    for (int s = 0; s < num_sums; s++) {
+        printf("%-28s %12f s  sum %.10f\n", sum_names[s], benchmark_stats(&bench, sum_names[s]).median,
+               sum_results[s]);
+    }
+    for (int h = 0; h < num_histograms; h++) {
+        printf("%-28s %12f s  largest error %g\n", histogram_names[h],
+               benchmark_stats(&bench, histogram_names[h]).median, histogram_errors[h]);
+    }
+    if (bench.results[0] != '\0') {
+        benchmark_write_results(&bench);
+    }
+    benchmark_destroy(&bench);
+
+    free(array);
+    free(bin_of);
+    free(bins);
+    free(expected);
+    return 0;
+}
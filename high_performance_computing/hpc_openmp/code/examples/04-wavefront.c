@@ -0,0 +1,164 @@
+/*
+ * Iterating a row update without a parallel region or a barrier per
+ * iteration.
+ *
+ * The matrix update example starts a parallel region for every iteration,
+ * gives each thread exactly one row, waits at a barrier and then copies the
+ * new matrix over the old one on a single thread. This runs the same kind
+ * of update, each row of the next iteration computed from the same row and
+ * the one above it, over any number of rows in three ways:
+ *
+ *   - region_per_iteration, a parallel for in every iteration followed by
+ *     a serial copy, as in the example
+ *   - persistent_barrier, one parallel region for every iteration, with a
+ *     barrier between them and the two copies of the matrix swapped rather
+ *     than copied
+ *   - wavefront, wavefront.h's executor, in which each thread only waits
+ *     for the threads holding the rows next to its own
+ *
+ * and checks that they give the same matrix, e.g.
+ *
+ *   OMP_NUM_THREADS=8 ./wavefront --rows 4096 --columns 64 --iterations 200 --repetitions 5
+ */
+
+#include <math.h>
+#include <omp.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../../../hpc_mpi/code/arralloc_aligned.h"
+#include "../../../hpc_mpi/code/benchmark.h"
+#include "../../../hpc_mpi/code/params.h"
+#include "../../../hpc_mpi/code/wavefront.h"
+
+static long num_rows;
+static long num_columns;
+static int num_iterations;
+static double **matrix[2];
+
+static void initialise_matrix(double **m)
+{
+#pragma omp parallel for schedule(static)
+    for (long i = 0; i < num_rows; ++i) {
+        for (long j = 0; j < num_columns; ++j) {
+            m[i][j] = i + j * 0.5;
+        }
+    }
+}
+
+/* The example's update, halved so the values stay the same size however
+   many iterations are run */
+static inline void update_row(double **current, double **next, long i)
+{
+    for (long j = 0; j < num_columns; ++j) {
+        if (i > 0) {
+            next[i][j] = 0.5 * (current[i][j] + current[i - 1][j]);
+        } else {
+            next[i][j] = 0.5 * (current[i][j] + 1.0);
+        }
+    }
+}
+
+/* The result is left in matrix[0] by the first, and in
+   matrix[num_iterations % 2] by the others */
+static void region_per_iteration(void)
+{
+    for (int iteration = 0; iteration < num_iterations; ++iteration) {
+#pragma omp parallel for schedule(static)
+        for (long i = 0; i < num_rows; ++i) {
+            update_row(matrix[0], matrix[1], i);
+        }
+        for (long i = 0; i < num_rows; ++i) {
+            for (long j = 0; j < num_columns; ++j) {
+                matrix[0][i][j] = matrix[1][i][j];
+            }
+        }
+    }
+}
+
+static void persistent_barrier(void)
+{
+#pragma omp parallel
+    for (int iteration = 0; iteration < num_iterations; ++iteration) {
+        /* The implicit barrier at the end of the loop separates the
+           iterations */
+#pragma omp for schedule(static)
+        for (long i = 0; i < num_rows; ++i) {
+            update_row(matrix[iteration % 2], matrix[(iteration + 1) % 2], i);
+        }
+    }
+}
+
+static void wavefront_update_row(int iteration, long row, void *context)
+{
+    double ***m = context;
+    update_row(m[iteration % 2], m[(iteration + 1) % 2], row);
+}
+
+static void wavefront(void)
+{
+    wavefront_run(num_rows, num_iterations, wavefront_update_row, matrix);
+}
+
+int main(int argc, char **argv)
+{
+    num_rows = param_long(argc, argv, "rows", 4096);
+    num_columns = param_long(argc, argv, "columns", 64);
+    num_iterations = param_long(argc, argv, "iterations", 200);
+    struct benchmark bench;
+    benchmark_create(&bench, argc, argv);
+    param_record_long("threads", omp_get_max_threads());
+    params_print_header(stdout, argv[0]);
+
+    size_t extents[2] = {num_rows, num_columns};
+    matrix[0] = arralloc_aligned(sizeof(double), 2, extents, 0, ARRALLOC_FIRST_TOUCH);
+    matrix[1] = arralloc_aligned(sizeof(double), 2, extents, 0, ARRALLOC_FIRST_TOUCH);
+    double **expected = arralloc_aligned(sizeof(double), 2, extents, 0, 0);
+    if (matrix[0] == NULL || matrix[1] == NULL || expected == NULL) {
+        fprintf(stderr, "Could not allocate three %ld x %ld matrices\n", num_rows, num_columns);
+        return 1;
+    }
+
+    const char *names[] = {"region_per_iteration", "persistent_barrier", "wavefront"};
+    void (*methods[])(void) = {region_per_iteration, persistent_barrier, wavefront};
+    const int num_methods = sizeof(methods) / sizeof(methods[0]);
+    double errors[3] = {0.0};
+
+    while (benchmark_next(&bench)) {
+        for (int method = 0; method < num_methods; method++) {
+            initialise_matrix(matrix[0]);
+            benchmark_start(&bench, names[method]);
+            methods[method]();
+            benchmark_stop(&bench, names[method]);
+
+            double **result = method == 0 ? matrix[0] : matrix[num_iterations % 2];
+            for (long i = 0; i < num_rows; ++i) {
+                for (long j = 0; j < num_columns; ++j) {
+                    if (method == 0) {
+                        expected[i][j] = result[i][j];
+                    } else {
+                        errors[method] = fmax(errors[method], fabs(result[i][j] - expected[i][j]));
+                    }
+                }
+            }
+        }
+    }
+
+    printf("%d iterations over %ld x %ld on %d threads\n", num_iterations, num_rows, num_columns,
+           omp_get_max_threads());
+    double first = benchmark_stats(&bench, names[0]).median;
+    for (int method = 0; method < num_methods; method++) {
+        double median = benchmark_stats(&bench, names[method]).median;
+        printf("%-22s %12f s  %6.2fx faster  largest difference %g\n", names[method], median, first / median,
+               errors[method]);
+    }
+    if (bench.results[0] != '\0') {
+        benchmark_write_results(&bench);
+    }
+    benchmark_destroy(&bench);
+
+    arrfree(matrix[0]);
+    arrfree(matrix[1]);
+    arrfree(expected);
+    return 0;
+}
@@ -1,45 +1,188 @@
 #include <stdlib.h>
 #include <stdio.h>
-#include <time.h>
+#include <string.h>
 #include <unistd.h>
 #include <mpi.h>
 #include <omp.h>
 
+#include "../../../hpc_mpi/code/benchmark.h"
+#include "../../../hpc_mpi/code/params.h"
+#include "../../../hpc_mpi/code/partition.h"
+#define PROGRESS_MPI
+#include "../../../hpc_mpi/code/progress.h"
+#include "../../../hpc_mpi/code/summation.h"
+
 #define ROOT_RANK 0
 #define PI 3.141592653589793238462643
 
-int main(void)
+/* The sum of the terms first to last - 1, kept in SUM_LANES separate sums which don't depend on each other, so the
+   compiler can work out SUM_LANES terms at once with SIMD instructions. Unlike a loop over every num_ranks-th term
+   the terms are next to each other, and the result doesn't change with the width of the vectors */
+static double block_sum(long first, long last, double h)
 {
-    struct timespec begin;
-    clock_gettime(CLOCK_MONOTONIC_RAW, &begin);
+    double sums[SUM_LANES] = {0.0};
+    long i = first;
+
+    for (; i + SUM_LANES <= last; i += SUM_LANES) {
+#pragma omp simd
+        for (int lane = 0; lane < SUM_LANES; ++lane) {
+            const double x = h * (double)(i + lane);
+            sums[lane] += 4.0 / (1.0 + x * x);
+        }
+    }
+    for (; i < last; ++i) {
+        const double x = h * (double)i;
+        sums[0] += 4.0 / (1.0 + x * x);
+    }
+    for (int width = SUM_LANES / 2; width > 0; width /= 2) {
+        for (int lane = 0; lane < width; ++lane) {
+            sums[lane] += sums[lane + width];
+        }
+    }
+    return sums[0];
+}
+
+/* Work out pi from the terms 0 to N, returning it on ROOT_RANK. With block set each rank, and each thread in it,
+   takes a contiguous range of the terms, otherwise the ranks take every num_ranks-th term. With interval set the
+   progress of the blocked summation is printed every interval seconds */
+static double calculate_pi(long N, int mode, int block, double interval, int my_rank, int num_ranks)
+{
+    const double h = 1.0 / N;
+    double reduced_pi = 0.0;
+
+    /* This rank's terms are first, first + stride, ..., count of them */
+    const long first = block ? partition_start(N + 1, my_rank, num_ranks) : my_rank;
+    const long stride = block ? 1 : num_ranks;
+    const long count = block ? partition_count(N + 1, my_rank, num_ranks)
+                             : my_rank <= N ? (N - my_rank) / num_ranks + 1 : 0;
+
+    if (mode == SUM_NAIVE) {
+        double sum = 0.0;
+
+        if (block) {
+#pragma omp parallel shared(first, count, h), reduction(+:sum)
+            {
+                const int thread = omp_get_thread_num();
+                const int num_threads = omp_get_num_threads();
+                const long thread_first = first + partition_start(count, thread, num_threads);
+                sum += block_sum(thread_first, thread_first + partition_count(count, thread, num_threads), h);
+            }
+        } else {
+#pragma omp parallel for shared(N, h, my_rank, num_ranks), reduction(+:sum)
+            for (long i = my_rank; i <= N; i = i + num_ranks) {
+                const double x = h * (double)i;
+                sum += 4.0 / (1.0 + x * x);
+            }
+        }
+        const double rank_pi = h * sum;
+
+        MPI_Reduce(&rank_pi, &reduced_pi, 1, MPI_DOUBLE, MPI_SUM, ROOT_RANK, MPI_COMM_WORLD);
+    } else {
+        /* Work out this rank's terms a block at a time and add them up on
+           each thread, merging the threads' totals with the reduction
+           declared in summation.h. The totals of every rank are then added
+           up with summation_reduce(). Each thread also counts the terms
+           it has done, for progress.h to add up over every rank */
+        struct summation total = summation_create(mode);
+        const long num_blocks = (count + SUM_BLOCK - 1) / SUM_BLOCK;
+        struct progress progress;
+        progress_create(&progress, "pi", count, interval);
+#pragma omp parallel shared(h, first, stride, count)
+        {
+            struct cache_line_counter *counter = progress_local(&progress);
+#pragma omp for reduction(summation : total)
+            for (long b = 0; b < num_blocks; ++b) {
+                double terms[SUM_BLOCK];
+                const long start = b * SUM_BLOCK;
+                const long n = count - start < SUM_BLOCK ? count - start : SUM_BLOCK;
+                for (long j = 0; j < n; ++j) {
+                    const double x = h * (double)(first + (start + j) * stride);
+                    terms[j] = 4.0 / (1.0 + x * x);
+                }
+                summation_add(&total, terms, n);
+                progress_add(counter, n);
+            }
+        }
+        progress_finish(&progress);
+        if (interval > 0.0) {
+            progress_report(&progress, stdout);
+        }
+        progress_destroy(&progress);
 
+        reduced_pi = h * summation_reduce(&total, ROOT_RANK, MPI_COMM_WORLD);
+    }
+
+    return reduced_pi;
+}
+
+int main(int argc, char **argv)
+{
     int my_rank;
     int num_ranks;
-    MPI_Init(NULL, NULL);
+    MPI_Init(&argc, &argv);
     MPI_Comm_rank(MPI_COMM_WORLD, &my_rank);
     MPI_Comm_size(MPI_COMM_WORLD, &num_ranks);
 
-    const long N = (long)1e10;
-    const double h = 1.0 / N;
-    double sum = 0.0;
-
-#pragma omp parallel for shared(N, h, my_rank, num_ranks), reduction(+:sum)
-    for (long i = my_rank; i <= N; i = i + num_ranks) {
-        const double x = h * (double)i;
-        sum += 4.0 / (1.0 + x * x);
+    /* --sum pairwise or --sum compensated adds up the terms more accurately, see summation.h.
+       --decomposition block gives each rank, and each thread, a contiguous range of terms, and --compare 1 also times the
+       cyclic loop with naive summation, to show the speedup. --interval 1 prints the progress of the pairwise or
+       compensated sums every second, over all of the ranks, see progress.h. --warmup and --repetitions run it more
+       than once, see benchmark.h */
+    struct benchmark bench;
+    benchmark_create(&bench, argc, argv);
+    const long N = param_long(argc, argv, "n", (long)1e10);
+    const char *sum_name = param_string(argc, argv, "sum", "naive");
+    const int mode = sum_mode_from_name(sum_name);
+    const char *decomposition = param_string(argc, argv, "decomposition", "cyclic");
+    const int block = strcmp(decomposition, "block") == 0;
+    const int compare = param_long(argc, argv, "compare", 0);
+    const double interval = param_double(argc, argv, "interval", 0.0);
+    if (mode < 0) {
+        if (my_rank == ROOT_RANK) {
+            fprintf(stderr, "Unknown summation %s, expected naive, pairwise or compensated\n", sum_name);
+        }
+        MPI_Finalize();
+        return 1;
     }
-    const double rank_pi = h * sum;
+    if (!block && strcmp(decomposition, "cyclic") != 0) {
+        if (my_rank == ROOT_RANK) {
+            fprintf(stderr, "Unknown decomposition %s, expected cyclic or block\n", decomposition);
+        }
+        MPI_Finalize();
+        return 1;
+    }
+    param_record_long("ranks", num_ranks);
+    param_record_long("threads", omp_get_max_threads());
+    if (my_rank == ROOT_RANK) {
+        params_print_header(stdout, argv[0]);
+    }
+
+    double reduced_pi = 0.0;
+    while (benchmark_next(&bench)) {
+        benchmark_start(&bench, "pi");
+        reduced_pi = calculate_pi(N, mode, block, interval, my_rank, num_ranks);
+        benchmark_stop(&bench, "pi");
 
-    double reduced_pi;
-    MPI_Reduce(&rank_pi, &reduced_pi, 1, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+        if (compare) {
+            benchmark_start(&bench, "cyclic");
+            calculate_pi(N, SUM_NAIVE, 0, 0.0, my_rank, num_ranks);
+            benchmark_stop(&bench, "cyclic");
+        }
+    }
+    const double seconds = benchmark_stats(&bench, "pi").median;
 
     if (my_rank == ROOT_RANK) {
-        struct timespec end;
-        clock_gettime(CLOCK_MONOTONIC_RAW, &end);
         printf("Calculated using %d OMP threads and %d MPI ranks\n", omp_get_max_threads(), num_ranks);
-        printf("Calculated pi %18.6f error %18.6f\n", reduced_pi, reduced_pi - PI);
-        printf("Total time = %f seconds\n", (end.tv_nsec - begin.tv_nsec) / 1000000000.0 + (end.tv_sec - begin.tv_sec));
+        printf("Calculated pi %.17g error %.3g with %s summation\n", reduced_pi, reduced_pi - PI, sum_name);
+        printf("Summed %ld terms with %s decomposition\n", N + 1, decomposition);
+        if (compare) {
+            const double cyclic_seconds = benchmark_stats(&bench, "cyclic").median;
+            printf("Cyclic naive loop took %f seconds, speedup %.2f\n", cyclic_seconds, cyclic_seconds / seconds);
+        }
+        printf("Total time = %f seconds\n", seconds);
     }
+    benchmark_report(&bench);
+    benchmark_destroy(&bench);
 
     MPI_Finalize();
 
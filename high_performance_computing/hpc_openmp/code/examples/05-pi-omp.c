@@ -1,40 +1,78 @@
 #include <stdio.h>
-#include <time.h>
 #include <unistd.h>
 #include <omp.h>
 
+#include "../../../hpc_mpi/code/benchmark.h"
+#include "../../../hpc_mpi/code/params.h"
+#include "../../../hpc_mpi/code/summation.h"
+
 #define PI 3.141592653589793238462643
 
-int main(void)
+int main(int argc, char **argv)
 {
-    struct timespec begin;
-    clock_gettime(CLOCK_MONOTONIC_RAW, &begin);
+    /* --sum pairwise or --sum compensated adds up the terms more accurately, see summation.h.
+       --warmup and --repetitions run it more than once, see benchmark.h */
+    struct benchmark bench;
+    benchmark_create(&bench, argc, argv);
+    const long N = param_long(argc, argv, "n", (long)1e10);
+    const char *sum_name = param_string(argc, argv, "sum", "naive");
+    const int mode = sum_mode_from_name(sum_name);
+    if (mode < 0) {
+        fprintf(stderr, "Unknown summation %s, expected naive, pairwise or compensated\n", sum_name);
+        return 1;
+    }
+    param_record_long("threads", omp_get_max_threads());
+    params_print_header(stdout, argv[0]);
 
     /* Initialise parameters. N is the number of rectangles we will sum over,
        and h is the width of each rectangle (1 / N) */
     double sum = 0.0;
-    const long N = (long)1e10;
     const double h = 1.0 / N;
 
-/* Parallelise the loop using a parallel for directive. We will set the sum
-   variable to be a reduction variable. As it is marked explicitly as a reduction
-   variable, we don't need to worry about any race conditions corrupting the
-   final value of sum */
+    while (benchmark_next(&bench)) {
+        benchmark_start(&bench, "pi");
+        sum = 0.0;
+        if (mode == SUM_NAIVE) {
+            /* Parallelise the loop using a parallel for directive. We will set the sum
+               variable to be a reduction variable. As it is marked explicitly as a reduction
+               variable, we don't need to worry about any race conditions corrupting the
+               final value of sum */
 #pragma omp parallel for shared(N, h), reduction(+:sum)
-    for (long i = 0; i <= N; ++i) {
-        const double x = h * (double)i;
-        sum += 4.0 / (1.0 + x * x);
+            for (long i = 0; i <= N; ++i) {
+                const double x = h * (double)i;
+                sum += 4.0 / (1.0 + x * x);
+            }
+        } else {
+            /* Each thread works out the terms a block at a time and adds them to
+               its own total, which are then merged by the summation reduction
+               declared in summation.h */
+            struct summation total = summation_create(mode);
+            const long num_blocks = N / SUM_BLOCK + 1;
+#pragma omp parallel for shared(N, h), reduction(summation : total)
+            for (long block = 0; block < num_blocks; ++block) {
+                double terms[SUM_BLOCK];
+                const long start = block * SUM_BLOCK;
+                const long n = N + 1 - start < SUM_BLOCK ? N + 1 - start : SUM_BLOCK;
+                for (long j = 0; j < n; ++j) {
+                    const double x = h * (double)(start + j);
+                    terms[j] = 4.0 / (1.0 + x * x);
+                }
+                summation_add(&total, terms, n);
+            }
+            sum = summation_value(&total);
+        }
+        benchmark_stop(&bench, "pi");
     }
 
     /* To attain our final value of pi, we multiply by h as we did not include
        this in the loop */
     const double pi = h * sum;
 
-    struct timespec end;
-    clock_gettime(CLOCK_MONOTONIC_RAW, &end);
     printf("Calculated using %d OMP threads\n", omp_get_max_threads());
-    printf("Calculated pi %18.6f error %18.6f\n", pi, pi - PI);
-    printf("Total time = %f seconds\n", (end.tv_nsec - begin.tv_nsec) / 1000000000.0 + (end.tv_sec - begin.tv_sec));
+    printf("Calculated pi %.17g error %.3g with %s summation\n", pi, pi - PI, sum_name);
+    printf("Total time = %f seconds\n", benchmark_stats(&bench, "pi").median);
+    benchmark_report(&bench);
+    benchmark_destroy(&bench);
 
     return 0;
 }
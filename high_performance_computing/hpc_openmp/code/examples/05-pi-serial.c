@@ -1,28 +1,61 @@
 #include <stdio.h>
-#include <time.h>
 #include <unistd.h>
 
+#include "../../../hpc_mpi/code/benchmark.h"
+#include "../../../hpc_mpi/code/params.h"
+#include "../../../hpc_mpi/code/summation.h"
+
 #define PI 3.141592653589793238462643
 
-int main(void)
+int main(int argc, char **argv)
 {
-    struct timespec begin, end;
-    clock_gettime(CLOCK_MONOTONIC_RAW, &begin);
+    /* --sum pairwise or --sum compensated adds up the terms more accurately, see summation.h.
+       --warmup and --repetitions run it more than once, see benchmark.h */
+    struct benchmark bench;
+    benchmark_create(&bench, argc, argv);
+    const long N = param_long(argc, argv, "n", (long)1e10);
+    const char *sum_name = param_string(argc, argv, "sum", "naive");
+    const int mode = sum_mode_from_name(sum_name);
+    if (mode < 0) {
+        fprintf(stderr, "Unknown summation %s, expected naive, pairwise or compensated\n", sum_name);
+        return 1;
+    }
+    params_print_header(stdout, argv[0]);
 
-    double sum = 0.0;
-    const long N = (long)1e10;
     const double h = 1.0 / N;
+    double sum = 0.0;
 
-    for (long i = 0; i <= N; ++i) {
-        const double x = h * (double)i;
-        sum += 4.0 / (1.0 + x * x);
+    while (benchmark_next(&bench)) {
+        benchmark_start(&bench, "pi");
+        sum = 0.0;
+        if (mode == SUM_NAIVE) {
+            for (long i = 0; i <= N; ++i) {
+                const double x = h * (double)i;
+                sum += 4.0 / (1.0 + x * x);
+            }
+        } else {
+            /* Work out the terms a block at a time, and add up each block */
+            struct summation total = summation_create(mode);
+            double terms[SUM_BLOCK];
+            for (long start = 0; start <= N; start += SUM_BLOCK) {
+                const long n = N + 1 - start < SUM_BLOCK ? N + 1 - start : SUM_BLOCK;
+                for (long j = 0; j < n; ++j) {
+                    const double x = h * (double)(start + j);
+                    terms[j] = 4.0 / (1.0 + x * x);
+                }
+                summation_add(&total, terms, n);
+            }
+            sum = summation_value(&total);
+        }
+        benchmark_stop(&bench, "pi");
     }
 
     const double pi = h * sum;
-    clock_gettime(CLOCK_MONOTONIC_RAW, &end);
 
-    printf("Calculated pi %18.6f error %18.6f\n", pi, pi - PI);
-    printf("Total time = %f seconds\n", (end.tv_nsec - begin.tv_nsec) / 1000000000.0 + (end.tv_sec - begin.tv_sec));
+    printf("Calculated pi %.17g error %.3g with %s summation\n", pi, pi - PI, sum_name);
+    printf("Total time = %f seconds\n", benchmark_stats(&bench, "pi").median);
+    benchmark_report(&bench);
+    benchmark_destroy(&bench);
 
     return 0;
 }
@@ -2,75 +2,132 @@
 #include <omp.h>
 #include <stdio.h>
 
+#include "../../../hpc_mpi/code/arralloc_aligned.h"
+#include "../../../hpc_mpi/code/benchmark.h"
+#include "../../../hpc_mpi/code/params.h"
+#include "../../../hpc_mpi/code/partition.h"
+#include "../../../hpc_mpi/code/schedule_tuner.h"
+
+/* Defaults, which can be changed at run time with --n, --num-threads and --num-iterations */
 #define N 729
 #define NUM_THREADS 2
 #define NUM_ITERATIONS 100
 
-double a[N][N], b[N][N];
+int n;
+double **a, **b;
+
+/* Allocate an n x n array, with its rows first touched by the threads
+ * that will use them under a static schedule */
+double **alloc_matrix(int n) {
+  size_t extents[2] = {n, n};
+  return arralloc_aligned(sizeof(double), 2, extents, 0, ARRALLOC_FIRST_TOUCH);
+}
 
 void init_loop(void) {
-  for (int i = 0; i < N; i++) {
-    for (int j = 0; j < N; j++) {
+  for (int i = 0; i < n; i++) {
+    for (int j = 0; j < n; j++) {
       a[i][j] = 0.0;
       b[i][j] = 3.142 * (i + j);
     }
   }
 }
 
+/* Row i has n - 1 - i elements to update, so the early rows take much longer
+ * than the later ones. The schedule is set with omp_set_schedule() */
 void unbalanced_loop(void) {
-  for (int i = 0; i < N; i++) {
-    for (int j = N - 1; j > i; j--) {
+#pragma omp parallel for schedule(runtime)
+  for (int i = 0; i < n; i++) {
+    for (int j = n - 1; j > i; j--) {
       a[i][j] += cos(b[i][j]);
     }
   }
 }
 
+/* The same loop, but as we know how much work each row is, each thread is
+ * given one contiguous range of rows with about the same number of updates,
+ * see partition.h */
+void partitioned_loop(void) {
+#pragma omp parallel
+  {
+    int thread = omp_get_thread_num();
+    int num_threads = omp_get_num_threads();
+    long first = partition_linear_start(n, thread, num_threads, n - 1, -1);
+    long last = partition_linear_start(n, thread + 1, num_threads, n - 1, -1);
+    for (long i = first; i < last; i++) {
+      for (int j = n - 1; j > i; j--) {
+        a[i][j] += cos(b[i][j]);
+      }
+    }
+  }
+}
+
 /* -----------------------------------------------------------------------------
  * Modify the code below this
  */
 
-int main(int argc, char **argv) {
-  int i;
-  int sum = 0;
-
+/* Time num_iterations runs of the loop with the given schedule, as a
+ * benchmark region called name, starting from the same matrix every time */
+void time_schedule(struct benchmark *bench, const char *name, omp_sched_t kind, int chunk_size, int num_iterations) {
+  omp_set_schedule(kind, chunk_size);
   init_loop();
-  omp_set_num_threads(NUM_THREADS);
-
-  double start;
-  double end;
-
-  start = omp_get_wtime();
-
-#pragma omp parallel for schedule(static)
-  for (i = 0; i < NUM_ELEMENTS; i++) {
+  benchmark_start(bench, name);
+  for (int i = 0; i < num_iterations; i++) {
     unbalanced_loop();
   }
+  benchmark_stop(bench, name);
+}
 
-  end = omp_get_wtime();
-
-  printf("Static: Total time per rep = %f\n", (end - start) / NUM_ELEMENTS);
-
-  start = omp_get_wtime();
-
-#pragma omp parallel for schedule(dynamic)
-  for (i = 0; i < NUM_ELEMENTS; i++) {
-    unbalanced_loop();
+int main(int argc, char **argv) {
+  n = param_long(argc, argv, "n", N);
+  int num_threads = param_long(argc, argv, "num_threads", NUM_THREADS);
+  int num_iterations = param_long(argc, argv, "num_iterations", NUM_ITERATIONS);
+  /* --schedule-cache <file> keeps the tuned schedule between runs, by default
+   * it's tuned again every run */
+  const char *schedule_cache = param_string(argc, argv, "schedule_cache", "");
+  struct benchmark bench;
+  benchmark_create(&bench, argc, argv);
+  params_print_header(stdout, argv[0]);
+
+  omp_set_num_threads(num_threads);
+  a = alloc_matrix(n);
+  b = alloc_matrix(n);
+
+  struct schedule_tuner tuner;
+  while (benchmark_next(&bench)) {
+    time_schedule(&bench, "static", omp_sched_static, 0, num_iterations);
+    time_schedule(&bench, "dynamic", omp_sched_dynamic, 0, num_iterations);
+    time_schedule(&bench, "guided", omp_sched_guided, 0, num_iterations);
+
+    init_loop();
+    benchmark_start(&bench, "cost_model");
+    for (int i = 0; i < num_iterations; i++) {
+      partitioned_loop();
+    }
+    benchmark_stop(&bench, "cost_model");
+
+    /* Let the loop try each schedule in its first runs and keep the fastest,
+     * see schedule_tuner.h. The time includes the runs spent tuning. */
+    init_loop();
+    schedule_tuner_create(&tuner, "unbalanced_loop", n, schedule_cache);
+    benchmark_start(&bench, "autotuned");
+    for (int i = 0; i < num_iterations; i++) {
+      schedule_tuner_begin(&tuner);
+      unbalanced_loop();
+      schedule_tuner_end(&tuner);
+    }
+    benchmark_stop(&bench, "autotuned");
   }
 
-  end = omp_get_wtime();
-
-  printf("Dynamic: Total time per rep = %f\n", (end - start) / NUM_ELEMENTS);
-
-  start = omp_get_wtime();
-
-#pragma omp parallel for schedule(guided)
-  for (i = 0; i < NUM_ELEMENTS; i++) {
-    unbalanced_loop();
+  printf("Static: Total time per rep = %f\n", benchmark_stats(&bench, "static").median / num_iterations);
+  printf("Dynamic: Total time per rep = %f\n", benchmark_stats(&bench, "dynamic").median / num_iterations);
+  printf("Guided: Total time per rep = %f\n", benchmark_stats(&bench, "guided").median / num_iterations);
+  printf("Cost model: Total time per rep = %f\n", benchmark_stats(&bench, "cost_model").median / num_iterations);
+  printf("Autotuned: Total time per rep = %f\n", benchmark_stats(&bench, "autotuned").median / num_iterations);
+  schedule_tuner_report(&tuner, stdout);
+  if (bench.results[0] != '\0') {
+    benchmark_write_results(&bench);
   }
-
-  end = omp_get_wtime();
-
-  printf("Guided: Total time per rep = %f\n", (end - start) / NUM_ELEMENTS);
+  benchmark_destroy(&bench);
 
   return 0;
 }
@@ -2,50 +2,76 @@
 #include <omp.h>
 #include <stdio.h>
 
+#include "../../../hpc_mpi/code/arralloc_aligned.h"
+#include "../../../hpc_mpi/code/benchmark.h"
+#include "../../../hpc_mpi/code/params.h"
+
+/* Defaults, which can be changed at run time with --n, --num-threads and --num-iterations */
 #define N 7290
 #define NUM_THREADS 4
 #define NUM_ITERATIONS 200
 
-double a[N][N], b[N][N];
+int n;
+double **a, **b;
+
+/* Allocate an n x n array, with its rows first touched by the threads
+ * that will use them under a static schedule */
+double **alloc_matrix(int n) {
+  size_t extents[2] = {n, n};
+  return arralloc_aligned(sizeof(double), 2, extents, 0, ARRALLOC_FIRST_TOUCH);
+}
 
 void init_loop(void) {
-  for (int i = 0; i < N; i++) {
-    for (int j = 0; j < N; j++) {
+  for (int i = 0; i < n; i++) {
+    for (int j = 0; j < n; j++) {
       a[i][j] = 0.0;
       b[i][j] = 3.142 * (i + j);
     }
   }
 }
 
+/* -----------------------------------------------------------------------------
+ * Modify the code below this
+ */
+
+/* Row i has n - 1 - i elements to update, so the early rows take much longer
+ * than the later ones */
 void unbalanced_loop(void) {
-  for (int i = 0; i < N; i++) {
-    for (int j = N - 1; j > i; j--) {
+#pragma omp parallel for
+  for (int i = 0; i < n; i++) {
+    for (int j = n - 1; j > i; j--) {
       a[i][j] += cos(b[i][j]);
     }
   }
 }
 
-/* -----------------------------------------------------------------------------
- * Modify the code below this
- */
-
 int main(int argc, char **argv) {
-  int i;
-  int sum = 0;
-
-  init_loop();
-  omp_set_num_threads(NUM_THREADS);
+  n = param_long(argc, argv, "n", N);
+  int num_threads = param_long(argc, argv, "num_threads", NUM_THREADS);
+  int num_iterations = param_long(argc, argv, "num_iterations", NUM_ITERATIONS);
+  struct benchmark bench;
+  benchmark_create(&bench, argc, argv);
+  params_print_header(stdout, argv[0]);
 
-  double start = omp_get_wtime();
+  omp_set_num_threads(num_threads);
+  a = alloc_matrix(n);
+  b = alloc_matrix(n);
 
-#pragma omp parallel for
-  for (i = 0; i < NUM_ELEMENTS; i++) {
-    unbalanced_loop();
+  /* Every repetition starts from the same matrix */
+  while (benchmark_next(&bench)) {
+    init_loop();
+    benchmark_start(&bench, "unbalanced_loop");
+    for (int i = 0; i < num_iterations; i++) {
+      unbalanced_loop();
+    }
+    benchmark_stop(&bench, "unbalanced_loop");
   }
 
-  double end = omp_get_wtime();
-
-  printf("Total time for %d reps = %f\n", NUM_ELEMENTS, end - start);
+  printf("Total time for %d reps = %f\n", num_iterations, benchmark_stats(&bench, "unbalanced_loop").median);
+  if (bench.results[0] != '\0') {
+    benchmark_write_results(&bench);
+  }
+  benchmark_destroy(&bench);
 
   return 0;
 }